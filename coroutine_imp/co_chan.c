@@ -0,0 +1,424 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "co_chan.h"
+#include "co_sync.h"
+
+enum select_state {
+    SELECT_WAITING,
+    SELECT_FIRED,
+    SELECT_CANCELLED,
+};
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+static bool can_wait(int64_t deadline) {
+    return deadline == -1 || deadline > co_now();
+}
+
+static void enqueue(struct co_chan_queue *queue, struct co_chan_waiter *waiter) {
+    waiter->next = NULL;
+    waiter->prev = queue->tail;
+    if (queue->tail == NULL) {
+        queue->head = waiter;
+    } else {
+        queue->tail->next = waiter;
+    }
+    queue->tail = waiter;
+    waiter->queued = true;
+}
+
+static void dequeue(struct co_chan_queue *queue, struct co_chan_waiter *waiter) {
+    if (waiter->prev == NULL) {
+        queue->head = waiter->next;
+    } else {
+        waiter->prev->next = waiter->next;
+    }
+    if (waiter->next == NULL) {
+        queue->tail = waiter->prev;
+    } else {
+        waiter->next->prev = waiter->prev;
+    }
+    waiter->prev = NULL;
+    waiter->next = NULL;
+    waiter->queued = false;
+}
+
+// 取队头一个可以交接的等待者。select 的等待者要先抢到它的 select，
+// 已经被别的 case 抢先的直接摘掉
+static struct co_chan_waiter *claim_waiter(struct co_chan_queue *queue) {
+    struct co_chan_waiter *waiter;
+    while ((waiter = queue->head) != NULL) {
+        if (waiter->set == NULL) {
+            return waiter;
+        }
+        int expected = SELECT_WAITING;
+        if (atomic_compare_exchange_strong(&waiter->set->state, &expected, SELECT_FIRED)) {
+            waiter->set->index = waiter->index;
+            return waiter;
+        }
+        dequeue(queue, waiter);
+    }
+    return NULL;
+}
+
+// 持锁时唤醒，对方醒来之后要拿锁才能看结果
+static void finish_waiter(struct co_chan_queue *queue, struct co_chan_waiter *waiter) {
+    dequeue(queue, waiter);
+    co_wakeup_remote(waiter->future);
+}
+
+static void ring_put(struct co_chan *chan, const char *src, size_t n) {
+    size_t size = chan->elem_size;
+    size_t tail = (chan->head + chan->len) % chan->cap;
+    size_t first = min_size(n, chan->cap - tail);
+    memcpy(chan->buf + tail * size, src, first * size);
+    memcpy(chan->buf, src + first * size, (n - first) * size);
+    chan->len += n;
+}
+
+static void ring_get(struct co_chan *chan, char *dst, size_t n) {
+    size_t size = chan->elem_size;
+    size_t first = min_size(n, chan->cap - chan->head);
+    memcpy(dst, chan->buf + chan->head * size, first * size);
+    memcpy(dst + first * size, chan->buf, (n - first) * size);
+    chan->head = (chan->head + n) % chan->cap;
+    chan->len -= n;
+}
+
+// 不挂起能发多少发多少：先直接交给在等的接收者，再放进缓冲区
+static void send_locked(struct co_chan *chan, const char *src, size_t n, size_t *done) {
+    size_t size = chan->elem_size;
+    while (*done < n) {
+        struct co_chan_waiter *receiver = claim_waiter(&chan->recvq);
+        if (receiver == NULL) {
+            break;
+        }
+        size_t count = min_size(n - *done, receiver->count - receiver->done);
+        memcpy(receiver->data + receiver->done * size, src + *done * size, count * size);
+        receiver->done += count;
+        *done += count;
+        finish_waiter(&chan->recvq, receiver);
+    }
+    if (*done < n && chan->len < chan->cap) {
+        size_t count = min_size(n - *done, chan->cap - chan->len);
+        ring_put(chan, src + *done * size, count);
+        *done += count;
+    }
+}
+
+// 不挂起能收多少收多少：先取缓冲区，腾出的位置用在等的发送者的数据补上，保持先进先出
+static void recv_locked(struct co_chan *chan, char *dst, size_t max, size_t *done) {
+    size_t size = chan->elem_size;
+    while (*done < max) {
+        struct co_chan_waiter *sender;
+        if (chan->len > 0) {
+            size_t count = min_size(max - *done, chan->len);
+            ring_get(chan, dst + *done * size, count);
+            *done += count;
+            while (chan->len < chan->cap && (sender = claim_waiter(&chan->sendq)) != NULL) {
+                count = min_size(sender->count - sender->done, chan->cap - chan->len);
+                ring_put(chan, sender->data + sender->done * size, count);
+                sender->done += count;
+                if (sender->done == sender->count) {
+                    finish_waiter(&chan->sendq, sender);
+                }
+            }
+            continue;
+        }
+        sender = claim_waiter(&chan->sendq);
+        if (sender == NULL) {
+            break;
+        }
+        size_t count = min_size(max - *done, sender->count - sender->done);
+        memcpy(dst + *done * size, sender->data + sender->done * size, count * size);
+        sender->done += count;
+        *done += count;
+        if (sender->done == sender->count) {
+            finish_waiter(&chan->sendq, sender);
+        }
+    }
+}
+
+int co_chan_init(struct co_chan *chan, size_t elem_size, size_t cap) {
+    atomic_flag_clear(&chan->lock);
+    chan->elem_size = elem_size;
+    chan->cap = cap;
+    chan->buf = NULL;
+    if (cap > 0) {
+        chan->buf = malloc(elem_size * cap);
+        if (chan->buf == NULL) {
+            return ENOMEM;
+        }
+    }
+    chan->head = 0;
+    chan->len = 0;
+    chan->closed = false;
+    chan->recvq = (struct co_chan_queue) {NULL, NULL};
+    chan->sendq = (struct co_chan_queue) {NULL, NULL};
+    return 0;
+}
+
+void co_chan_destroy(struct co_chan *chan) {
+    free(chan->buf);
+    chan->buf = NULL;
+}
+
+static void close_waiters(struct co_chan_queue *queue) {
+    struct co_chan_waiter *waiter;
+    while ((waiter = claim_waiter(queue)) != NULL) {
+        waiter->closed = true;
+        finish_waiter(queue, waiter);
+    }
+}
+
+void co_chan_close(struct co_chan *chan) {
+    co_spin_lock(&chan->lock);
+    if (!chan->closed) {
+        chan->closed = true;
+        close_waiters(&chan->recvq);
+        close_waiters(&chan->sendq);
+    }
+    co_spin_unlock(&chan->lock);
+}
+
+// 挂起直到对方把等待者摘走、超时或者被取消，后两种情况还在队列里就自己摘掉。
+// 返回 co_block_until 的结果，对方摘走时也可能同时超时，以 waiter 里的结果为准
+static int wait_transfer(struct co_chan *chan, struct co_chan_queue *queue, struct co_chan_waiter *waiter,
+                         int64_t deadline) {
+    waiter->future = co_current_future();
+    waiter->set = NULL;
+    waiter->closed = false;
+    enqueue(queue, waiter);
+    co_spin_unlock(&chan->lock);
+    int ret = co_block_until(deadline);
+    if (ret != 0) {
+        co_spin_lock(&chan->lock);
+        if (waiter->queued) {
+            dequeue(queue, waiter);
+        }
+        co_spin_unlock(&chan->lock);
+    }
+    return ret;
+}
+
+ssize_t co_chan_send_batch(struct co_chan *chan, const void *items, size_t n, int64_t deadline) {
+    size_t done = 0;
+    co_spin_lock(&chan->lock);
+    if (chan->closed) {
+        co_spin_unlock(&chan->lock);
+        return -EPIPE;
+    }
+    send_locked(chan, items, n, &done);
+    if (done == n || !can_wait(deadline)) {
+        co_spin_unlock(&chan->lock);
+        return done > 0 || n == 0 ? (ssize_t) done : -ETIMEDOUT;
+    }
+    if (co_current_on_shared_stack()) {
+        co_spin_unlock(&chan->lock);
+        return done > 0 ? (ssize_t) done : -EINVAL;
+    }
+    // 剩下的挂在发送队列上，由接收者直接从 items 里取
+    struct co_chan_waiter waiter = {
+            .data = (char *) items,
+            .count = n,
+            .done = done,
+    };
+    int ret = wait_transfer(chan, &chan->sendq, &waiter, deadline);
+    if (waiter.done > 0) {
+        return (ssize_t) waiter.done;
+    }
+    return waiter.closed ? -EPIPE : -ret;
+}
+
+ssize_t co_chan_recv_batch(struct co_chan *chan, void *items, size_t max, int64_t deadline) {
+    size_t done = 0;
+    co_spin_lock(&chan->lock);
+    recv_locked(chan, items, max, &done);
+    if (done > 0 || max == 0) {
+        co_spin_unlock(&chan->lock);
+        return (ssize_t) done;
+    }
+    if (chan->closed || !can_wait(deadline)) {
+        bool closed = chan->closed;
+        co_spin_unlock(&chan->lock);
+        return closed ? -EPIPE : -ETIMEDOUT;
+    }
+    if (co_current_on_shared_stack()) {
+        co_spin_unlock(&chan->lock);
+        return -EINVAL;
+    }
+    // 发送者把数据直接拷进 items，拷了就叫醒，不等凑满 max 个
+    struct co_chan_waiter waiter = {
+            .data = items,
+            .count = max,
+            .done = 0,
+    };
+    int ret = wait_transfer(chan, &chan->recvq, &waiter, deadline);
+    if (waiter.done > 0) {
+        return (ssize_t) waiter.done;
+    }
+    return waiter.closed ? -EPIPE : -ret;
+}
+
+int co_chan_send(struct co_chan *chan, const void *item, int64_t deadline) {
+    ssize_t ret = co_chan_send_batch(chan, item, 1, deadline);
+    return ret == 1 ? 0 : (int) -ret;
+}
+
+int co_chan_recv(struct co_chan *chan, void *item, int64_t deadline) {
+    ssize_t ret = co_chan_recv_batch(chan, item, 1, deadline);
+    return ret == 1 ? 0 : (int) -ret;
+}
+
+int co_chan_try_send(struct co_chan *chan, const void *item) {
+    int ret = co_chan_send(chan, item, 0);
+    return ret == ETIMEDOUT ? EAGAIN : ret;
+}
+
+int co_chan_try_recv(struct co_chan *chan, void *item) {
+    int ret = co_chan_recv(chan, item, 0);
+    return ret == ETIMEDOUT ? EAGAIN : ret;
+}
+
+// 持锁时尝试完成一个 case，要么完整做完，要么什么也不做
+static bool try_case(struct co_chan_case *c) {
+    struct co_chan *chan = c->chan;
+    size_t done = 0;
+    if (c->dir == CO_CHAN_SEND) {
+        if (chan->closed) {
+            c->ok = false;
+            return true;
+        }
+        send_locked(chan, c->item, 1, &done);
+    } else {
+        recv_locked(chan, c->item, 1, &done);
+        if (done == 0 && chan->closed) {
+            c->ok = false;
+            return true;
+        }
+    }
+    c->ok = true;
+    return done == 1;
+}
+
+static int try_cases(struct co_chan_case *cases, int n) {
+    for (int i = 0; i < n; i++) {
+        if (cases[i].chan != NULL && try_case(&cases[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 按地址顺序给涉及的 channel 加锁，同一个 channel 只锁一次
+static int lock_channels(struct co_chan_case *cases, int n, struct co_chan **locked) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        struct co_chan *chan = cases[i].chan;
+        if (chan == NULL) {
+            continue;
+        }
+        int pos = count;
+        while (pos > 0 && locked[pos - 1] > chan) {
+            pos--;
+        }
+        if (pos > 0 && locked[pos - 1] == chan) {
+            continue;
+        }
+        memmove(&locked[pos + 1], &locked[pos], (count - pos) * sizeof(locked[0]));
+        locked[pos] = chan;
+        count++;
+    }
+    for (int i = 0; i < count; i++) {
+        co_spin_lock(&locked[i]->lock);
+    }
+    return count;
+}
+
+static void unlock_channels(struct co_chan **locked, int count) {
+    for (int i = 0; i < count; i++) {
+        co_spin_unlock(&locked[i]->lock);
+    }
+}
+
+static struct co_chan_queue *case_queue(struct co_chan_case *c) {
+    return c->dir == CO_CHAN_SEND ? &c->chan->sendq : &c->chan->recvq;
+}
+
+int co_chan_arm(struct co_chan_wait_set *set, struct co_chan_case *cases, int n, struct co_future future) {
+    struct co_chan *locked[CO_CHAN_SELECT_MAX];
+    int locked_count = lock_channels(cases, n, locked);
+    // 全部锁住时别人抢不到这次等待，能马上完成的 case 直接做
+    int index = try_cases(cases, n);
+    if (index != -1) {
+        unlock_channels(locked, locked_count);
+        return index;
+    }
+    atomic_init(&set->state, SELECT_WAITING);
+    set->index = -1;
+    for (int i = 0; i < n; i++) {
+        if (cases[i].chan == NULL) {
+            continue;
+        }
+        set->waiters[i] = (struct co_chan_waiter) {
+                .future = future,
+                .data = cases[i].item,
+                .count = 1,
+                .done = 0,
+                .set = set,
+                .index = i,
+        };
+        enqueue(case_queue(&cases[i]), &set->waiters[i]);
+    }
+    unlock_channels(locked, locked_count);
+    return -1;
+}
+
+int co_chan_disarm(struct co_chan_wait_set *set, struct co_chan_case *cases, int n) {
+    // 和完成抢同一个状态，抢输了说明已经有 case 完成了
+    int expected = SELECT_WAITING;
+    atomic_compare_exchange_strong(&set->state, &expected, SELECT_CANCELLED);
+    for (int i = 0; i < n; i++) {
+        if (cases[i].chan == NULL) {
+            continue;
+        }
+        co_spin_lock(&cases[i].chan->lock);
+        if (set->waiters[i].queued) {
+            dequeue(case_queue(&cases[i]), &set->waiters[i]);
+        }
+        co_spin_unlock(&cases[i].chan->lock);
+    }
+    // 完成的一方在 channel 锁里写 index，上面拿过锁之后一定看得到
+    if (set->index != -1) {
+        cases[set->index].ok = !set->waiters[set->index].closed;
+    }
+    return set->index;
+}
+
+int co_chan_select(struct co_chan_case *cases, int n, int64_t deadline) {
+    if (n > CO_CHAN_SELECT_MAX) {
+        return -2;
+    }
+    // 共享栈协程只能试一次，挂起之后栈上的等待者和 item 都会失效
+    bool shared = co_current_on_shared_stack();
+    if (!can_wait(deadline) || shared) {
+        struct co_chan *locked[CO_CHAN_SELECT_MAX];
+        int locked_count = lock_channels(cases, n, locked);
+        int index = try_cases(cases, n);
+        unlock_channels(locked, locked_count);
+        return index == -1 && shared && can_wait(deadline) ? -2 : index;
+    }
+    struct co_chan_wait_set set;
+    int index = co_chan_arm(&set, cases, n, co_current_future());
+    if (index != -1) {
+        return index;
+    }
+    co_block_until(deadline);
+    return co_chan_disarm(&set, cases, n);
+}
@@ -0,0 +1,116 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_CO_CHAN_H
+#define EPOLL_COROUTINE_CO_CHAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "coroutines.h"
+
+#define CO_CHAN_SELECT_MAX 16
+
+// 有界 channel，元素按值拷贝。容量为 0 时没有缓冲区，发送方和接收方直接交接。
+// 等待者挂在 channel 上，数据直接拷进对方的缓冲区再用 co_wakeup_remote 叫醒，可以跨事件循环使用。
+// 会挂起的函数只能在协程里调用；deadline 为 co_now() 的时间，-1 表示不限时，已经过去的时间表示不等。
+// 等待者和收发的元素都不能放在 CO_STACK_SHARED 协程的栈上，这类协程需要挂起时返回 EINVAL，不挂起的收发不受影响
+
+struct co_chan_wait_set;
+
+// 等待者放在等待协程的栈上，对方直接读写 data 指向的元素
+struct co_chan_waiter {
+    struct co_chan_waiter *prev;
+    struct co_chan_waiter *next;
+    struct co_future future;
+    char *data;
+    size_t count;
+    size_t done;
+    // 同时等多个 case 时指向共用的状态，否则为 NULL
+    struct co_chan_wait_set *set;
+    int index;
+    bool queued;
+    bool closed;
+};
+
+// 同时在多个 case 上等待的状态，放在等待协程的栈上，所以不支持共享栈。各个 case 的等待者共用 state，谁先 CAS 成功谁完成
+struct co_chan_wait_set {
+    atomic_int state;
+    int index;
+    struct co_chan_waiter waiters[CO_CHAN_SELECT_MAX];
+};
+
+struct co_chan_queue {
+    struct co_chan_waiter *head;
+    struct co_chan_waiter *tail;
+};
+
+struct co_chan {
+    atomic_flag lock;
+    size_t elem_size;
+    size_t cap;
+    // 环形缓冲区
+    char *buf;
+    size_t head;
+    size_t len;
+    bool closed;
+    // 缓冲区空时才会有接收者在等，满时才会有发送者在等
+    struct co_chan_queue recvq;
+    struct co_chan_queue sendq;
+};
+
+enum co_chan_dir {
+    CO_CHAN_SEND,
+    CO_CHAN_RECV,
+};
+
+struct co_chan_case {
+    // 为 NULL 的 case 永远不会完成
+    struct co_chan *chan;
+    enum co_chan_dir dir;
+    void *item;
+    // channel 已经关闭时为 false，接收的话 item 没有被写入
+    bool ok;
+};
+
+// 成功返回 0，失败返回 ENOMEM
+int co_chan_init(struct co_chan *chan, size_t elem_size, size_t cap);
+
+// 调用时不能再有协程在等这个 channel
+void co_chan_destroy(struct co_chan *chan);
+
+// 关闭后发送返回 EPIPE，接收方取完缓冲区里剩下的数据后返回 EPIPE
+void co_chan_close(struct co_chan *chan);
+
+// 成功返回 0，channel 已关闭返回 EPIPE，超时返回 ETIMEDOUT，被 co_cancel 取消返回 ECANCELED，共享栈协程需要等待时返回 EINVAL
+int co_chan_send(struct co_chan *chan, const void *item, int64_t deadline);
+
+int co_chan_recv(struct co_chan *chan, void *item, int64_t deadline);
+
+// 不挂起，做不了返回 EAGAIN
+int co_chan_try_send(struct co_chan *chan, const void *item);
+
+int co_chan_try_recv(struct co_chan *chan, void *item);
+
+// 一直等到 n 个元素全部发出，返回发出的个数；一个都没发出时返回 -EPIPE、-ETIMEDOUT、-ECANCELED 或 -EINVAL
+ssize_t co_chan_send_batch(struct co_chan *chan, const void *items, size_t n, int64_t deadline);
+
+// 有数据就尽量多拿，最多 max 个，返回拿到的个数；没有数据时等到有为止，失败返回 -EPIPE、-ETIMEDOUT、-ECANCELED 或 -EINVAL
+ssize_t co_chan_recv_batch(struct co_chan *chan, void *items, size_t max, int64_t deadline);
+
+// 等到其中一个 case 完成，返回它的下标。同时能完成的按下标顺序选第一个；
+// 超时或者被取消返回 -1，case 超过 CO_CHAN_SELECT_MAX 个或者共享栈协程需要等待时返回 -2
+int co_chan_select(struct co_chan_case *cases, int n, int64_t deadline);
+
+// 给 co_select 用，n 不能超过 CO_CHAN_SELECT_MAX。能马上完成的 case 直接完成并返回下标；
+// 否则在每个 case 上挂等待者，完成时叫醒 future，返回 -1，之后必须调用 co_chan_disarm。
+// set 在 disarm 之前一直被别的协程读写，调用者不能在共享栈上
+int co_chan_arm(struct co_chan_wait_set *set, struct co_chan_case *cases, int n, struct co_future future);
+
+// 摘掉等待者，返回已经完成的 case 的下标，没有返回 -1。返回之后不会再有 case 完成
+int co_chan_disarm(struct co_chan_wait_set *set, struct co_chan_case *cases, int n);
+
+#endif //EPOLL_COROUTINE_CO_CHAN_H
@@ -0,0 +1,575 @@
+//
+// Created by agent on 26-10-17.
+//
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include "co_io.h"
+
+#define READ_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)
+#define WRITE_EVENTS (EPOLLOUT | EPOLLHUP | EPOLLERR)
+
+enum zerocopy_state {
+    ZEROCOPY_UNKNOWN = 0,
+    ZEROCOPY_ON,
+    ZEROCOPY_OFF,
+};
+
+static bool use_uring(struct co_io *io) {
+    return co_loop_io_kind(io->loop) == CO_IO_URING;
+}
+
+// io_uring 的结果是 -errno，转成和系统调用一样的约定
+static ssize_t uring_result(ssize_t ret) {
+    if (ret < 0) {
+        errno = (int) -ret;
+        return -1;
+    }
+    return ret;
+}
+
+static int check_loop(struct co_io *io) {
+    // 注册在别的线程的 epoll 上，等不到事件
+    if (io->loop != co_get_loop()) {
+        errno = EXDEV;
+        return -1;
+    }
+    return 0;
+}
+
+static int io_register(struct co_io *io) {
+    if (io->interest != 0) {
+        return 0;
+    }
+    // io_uring 读写不维护就绪状态，注册时清掉，EPOLL_CTL_ADD 会立即报告当前已经就绪的事件
+    if (use_uring(io)) {
+        io->ready = 0;
+    }
+    struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.u64 = (uintptr_t) io | CO_IO_EVENT_TAG,
+    };
+    if (epoll_ctl(co_loop_epoll_fd(io->loop), EPOLL_CTL_ADD, io->fd, &event) == -1) {
+        return -1;
+    }
+    io->interest = event.events;
+    return 0;
+}
+
+int co_io_open(struct co_io *io, int fd) {
+    io->fd = fd;
+    io->loop = co_get_loop();
+    io->interest = 0;
+    // 没收到 EAGAIN 之前先假设可读可写，第一次直接尝试系统调用
+    io->ready = EPOLLIN | EPOLLOUT;
+    io->reader.co = NULL;
+    io->writer.co = NULL;
+    io->acceptor = NULL;
+    io->zerocopy = ZEROCOPY_UNKNOWN;
+    io->zc_sent = 0;
+    io->zc_done = 0;
+    int type;
+    socklen_t len = sizeof(type);
+    io->stream = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1 || type == SOCK_STREAM;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+        return -1;
+    }
+    if (use_uring(io)) {
+        return 0;
+    }
+    return io_register(io);
+}
+
+void co_io_release(struct co_io *io) {
+    if (io->acceptor != NULL) {
+        co_uring_acceptor_deinit(io->acceptor);
+        free(io->acceptor);
+        io->acceptor = NULL;
+    }
+}
+
+int co_io_close(struct co_io *io) {
+    if (io->acceptor != NULL) {
+        // multishot accept 结束之前 acceptor 还会被内核引用
+        co_uring_acceptor_cancel(io->acceptor);
+        co_io_release(io);
+    }
+    // fd 关闭时 epoll 会自动删掉注册，不用再 EPOLL_CTL_DEL
+    if (use_uring(io) && co_get_loop() == io->loop) {
+        return (int) uring_result(co_uring_close(io->fd));
+    }
+    return close(io->fd);
+}
+
+void co_io_on_event(uint64_t data, uint32_t events) {
+    struct co_io *io = (struct co_io *) (uintptr_t) (data & ~(uint64_t) CO_IO_EVENT_TAG);
+    if (events & READ_EVENTS) {
+        io->ready |= EPOLLIN;
+        if (io->reader.co != NULL) {
+            co_wakeup(io->loop, io->reader);
+            io->reader.co = NULL;
+        }
+    }
+    if (events & WRITE_EVENTS) {
+        // 错误队列里有 MSG_ZEROCOPY 的完成通知时也是 EPOLLERR，单独记下来
+        io->ready |= EPOLLOUT | (events & EPOLLERR);
+        if (io->writer.co != NULL) {
+            co_wakeup(io->loop, io->writer);
+            io->writer.co = NULL;
+        }
+    }
+}
+
+static int wait_ready(struct co_io *io, uint32_t event, int64_t deadline) {
+    if (io_register(io) != 0) {
+        return -1;
+    }
+    // 等错误队列和等可写一样由 writer 负责
+    struct co_future *slot = event == EPOLLIN ? &io->reader : &io->writer;
+    co_pin();
+    // 数据一直是就绪的话不会挂起，在这里给看门狗一个让出的机会
+    co_maybe_yield();
+    while (!(io->ready & event)) {
+        *slot = co_current_future();
+        int ret = co_block_until(deadline);
+        slot->co = NULL;
+        if (ret != 0) {
+            errno = ret;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int co_io_arm(struct co_io *io, uint32_t event, struct co_future future) {
+    if (check_loop(io) != 0 || io_register(io) != 0) {
+        return -1;
+    }
+    if (io->ready & event) {
+        return 1;
+    }
+    co_pin();
+    if (event == EPOLLIN) {
+        io->reader = future;
+    } else {
+        io->writer = future;
+    }
+    return 0;
+}
+
+bool co_io_disarm(struct co_io *io, uint32_t event, struct co_future future) {
+    struct co_future *slot = event == EPOLLIN ? &io->reader : &io->writer;
+    if (slot->co == future.co && slot->gen == future.gen) {
+        slot->co = NULL;
+    }
+    return (io->ready & event) != 0;
+}
+
+// 读写之后更新就绪状态，返回 true 表示应该等待下一次事件
+static bool update_ready(struct co_io *io, uint32_t event, ssize_t ret, size_t want) {
+    if (ret >= 0) {
+        // 流式 fd 没读满（写满）说明内核缓冲区已经空了（满了）
+        if (io->stream && ret > 0 && (size_t) ret < want) {
+            io->ready &= ~event;
+        }
+        return false;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        io->ready &= ~event;
+        return true;
+    }
+    return false;
+}
+
+ssize_t co_read(struct co_io *io, void *buf, size_t count, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    if (use_uring(io)) {
+        // 和 epoll 路径一样，提交前给看门狗一个让出的机会
+        co_maybe_yield();
+        ssize_t ret = uring_result(co_uring_read(io->fd, buf, count, deadline));
+        // 已经注册到 epoll 时，读不满同样说明缓冲区读空了
+        if (io->interest != 0) {
+            update_ready(io, EPOLLIN, ret, count);
+        }
+        return ret;
+    }
+    while (true) {
+        if (wait_ready(io, EPOLLIN, deadline) != 0) {
+            return -1;
+        }
+        ssize_t ret = read(io->fd, buf, count);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (!update_ready(io, EPOLLIN, ret, count)) {
+            return ret;
+        }
+    }
+}
+
+int co_wait_readable(struct co_io *io, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    return wait_ready(io, EPOLLIN, deadline);
+}
+
+ssize_t co_readv(struct co_io *io, const struct iovec *iov, int iovcnt, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    size_t want = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        want += iov[i].iov_len;
+    }
+    while (true) {
+        if (wait_ready(io, EPOLLIN, deadline) != 0) {
+            return -1;
+        }
+        ssize_t ret = readv(io->fd, iov, iovcnt);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (!update_ready(io, EPOLLIN, ret, want)) {
+            return ret;
+        }
+    }
+}
+
+ssize_t co_write(struct co_io *io, const void *buf, size_t count, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    const char *pos = buf;
+    size_t left = count;
+    while (left > 0) {
+        ssize_t ret;
+        if (use_uring(io)) {
+            co_maybe_yield();
+            ret = uring_result(co_uring_write(io->fd, pos, left, deadline));
+            // 写出 0 字节不算进展，否则会一直重发同一个请求
+            if (ret == 0) {
+                errno = EIO;
+                return -1;
+            }
+        } else {
+            if (wait_ready(io, EPOLLOUT, deadline) != 0) {
+                return -1;
+            }
+            ret = write(io->fd, pos, left);
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            if (update_ready(io, EPOLLOUT, ret, left)) {
+                continue;
+            }
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        pos += ret;
+        left -= ret;
+    }
+    return (ssize_t) count;
+}
+
+// 跳过已经写出去的部分，返回剩下的第一个 iovec
+static int advance_iov(struct iovec **iov, int iovcnt, size_t written) {
+    while (iovcnt > 0 && written >= (*iov)->iov_len) {
+        written -= (*iov)->iov_len;
+        (*iov)++;
+        iovcnt--;
+    }
+    if (iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + written;
+        (*iov)->iov_len -= written;
+    }
+    return iovcnt;
+}
+
+ssize_t co_writev(struct co_io *io, struct iovec *iov, int iovcnt, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    size_t left = total;
+    // 跳过开头的空 iovec
+    iovcnt = advance_iov(&iov, iovcnt, 0);
+    while (left > 0) {
+        if (wait_ready(io, EPOLLOUT, deadline) != 0) {
+            return -1;
+        }
+        ssize_t ret = writev(io->fd, iov, iovcnt);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (update_ready(io, EPOLLOUT, ret, left)) {
+            continue;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        left -= ret;
+        iovcnt = advance_iov(&iov, iovcnt, ret);
+    }
+    return (ssize_t) total;
+}
+
+ssize_t co_sendfile(struct co_io *out, int in_fd, off_t *offset, size_t count, int64_t deadline) {
+    if (check_loop(out) != 0) {
+        return -1;
+    }
+    size_t sent = 0;
+    while (sent < count) {
+        if (wait_ready(out, EPOLLOUT, deadline) != 0) {
+            return -1;
+        }
+        ssize_t ret = sendfile(out->fd, in_fd, offset, count - sent);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        // 文件读完也会返回不满，只能以 EAGAIN 判断 socket 写满
+        if (update_ready(out, EPOLLOUT, ret, 0)) {
+            continue;
+        }
+        if (ret < 0) {
+            return sent > 0 ? (ssize_t) sent : -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        sent += ret;
+    }
+    return (ssize_t) sent;
+}
+
+ssize_t co_splice(struct co_io *in, struct co_io *out, size_t len, unsigned int flags, int64_t deadline) {
+    if (check_loop(in) != 0 || check_loop(out) != 0) {
+        return -1;
+    }
+    while (true) {
+        if (wait_ready(in, EPOLLIN, deadline) != 0 || wait_ready(out, EPOLLOUT, deadline) != 0) {
+            return -1;
+        }
+        ssize_t ret = splice(in->fd, NULL, out->fd, NULL, len, flags | SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (ret >= 0 || errno != EAGAIN) {
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            return ret;
+        }
+        // EAGAIN 分不清是哪一端，查一下再清掉对应的就绪状态
+        struct pollfd fds[2] = {
+                {.fd = in->fd, .events = POLLIN},
+                {.fd = out->fd, .events = POLLOUT},
+        };
+        if (poll(fds, 2, 0) == -1) {
+            return -1;
+        }
+        bool in_ready = fds[0].revents & (POLLIN | POLLHUP | POLLERR);
+        bool out_ready = fds[1].revents & (POLLOUT | POLLHUP | POLLERR);
+        // 两端都就绪却还是 EAGAIN 时两边都清掉，等下一个边沿再试，不能空转
+        if (!in_ready || out_ready) {
+            in->ready &= ~EPOLLIN;
+        }
+        if (!out_ready || in_ready) {
+            out->ready &= ~EPOLLOUT;
+        }
+    }
+}
+
+// 从错误队列读取完成通知，返回 -1 表示队列暂时空了
+static int reap_zerocopy(struct co_io *io) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+    };
+    if (recvmsg(io->fd, &msg, MSG_ERRQUEUE) == -1) {
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            continue;
+        }
+        // [ee_info, ee_data] 是完成的 send 序号区间，按顺序到达
+        io->zc_done = err->ee_data + 1;
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            io->zerocopy = ZEROCOPY_OFF;
+        }
+    }
+    return 0;
+}
+
+static int wait_zerocopy(struct co_io *io, int64_t deadline) {
+    while (io->zc_done != io->zc_sent) {
+        if (reap_zerocopy(io) == 0) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        io->ready &= ~EPOLLERR;
+        if (wait_ready(io, EPOLLERR, deadline) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ssize_t co_send_zerocopy(struct co_io *io, const void *buf, size_t count, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    if (io->zerocopy == ZEROCOPY_UNKNOWN) {
+        int one = 1;
+        bool ok = setsockopt(io->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        io->zerocopy = ok ? ZEROCOPY_ON : ZEROCOPY_OFF;
+    }
+    if (io->zerocopy == ZEROCOPY_OFF || count < CO_ZEROCOPY_MIN) {
+        return co_write(io, buf, count, deadline);
+    }
+    const char *pos = buf;
+    size_t left = count;
+    while (left > 0) {
+        if (wait_ready(io, EPOLLOUT, deadline) != 0) {
+            return -1;
+        }
+        ssize_t ret = send(io->fd, pos, left, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1 && errno == ENOBUFS) {
+            // 固定的页面超过了 optmem 限制，先等已有的完成，没有在途的就直接拷贝
+            if (io->zc_done == io->zc_sent) {
+                if (co_write(io, pos, left, deadline) == -1) {
+                    return -1;
+                }
+                break;
+            }
+            if (wait_zerocopy(io, deadline) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (update_ready(io, EPOLLOUT, ret, left)) {
+            continue;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        // 每次成功的 send 占一个完成序号
+        io->zc_sent++;
+        pos += ret;
+        left -= ret;
+    }
+    if (wait_zerocopy(io, deadline) != 0) {
+        return -1;
+    }
+    return (ssize_t) count;
+}
+
+int co_accept(struct co_io *io, struct sockaddr *addr, socklen_t *addrlen, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    if (use_uring(io) && deadline == -1) {
+        co_maybe_yield();
+        if (io->acceptor == NULL) {
+            io->acceptor = malloc(sizeof(struct co_uring_acceptor));
+            if (io->acceptor == NULL) {
+                return -1;
+            }
+            co_uring_acceptor_init(io->acceptor, io->fd);
+        }
+        int fd = (int) uring_result(co_uring_accept(io->acceptor));
+        // multishot accept 不带对端地址，需要时再单独取
+        if (fd >= 0 && addr != NULL) {
+            getpeername(fd, addr, addrlen);
+        }
+        return fd;
+    }
+    while (true) {
+        if (wait_ready(io, EPOLLIN, deadline) != 0) {
+            return -1;
+        }
+        int fd = accept4(io->fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1 && errno == EINTR) {
+            continue;
+        }
+        if (!update_ready(io, EPOLLIN, fd, 0)) {
+            return fd;
+        }
+    }
+}
+
+int co_io_pause(struct co_io *io) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    if (io->acceptor != NULL) {
+        // 已经 accept 到缓存里的连接留着，恢复后先取出来
+        co_uring_acceptor_cancel(io->acceptor);
+    }
+    if (io->interest == 0) {
+        return 0;
+    }
+    if (epoll_ctl(co_loop_epoll_fd(io->loop), EPOLL_CTL_DEL, io->fd, NULL) == -1) {
+        return -1;
+    }
+    io->interest = 0;
+    return 0;
+}
+
+int co_io_resume(struct co_io *io) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    // io_uring 模式下用到 epoll 时才注册，accept 会重新提交
+    if (use_uring(io)) {
+        return 0;
+    }
+    return io_register(io);
+}
+
+int co_connect(struct co_io *io, const struct sockaddr *addr, socklen_t addrlen, int64_t deadline) {
+    if (check_loop(io) != 0) {
+        return -1;
+    }
+    if (connect(io->fd, addr, addrlen) == 0) {
+        return 0;
+    }
+    if (errno != EINPROGRESS) {
+        return -1;
+    }
+    io->ready &= ~EPOLLOUT;
+    if (wait_ready(io, EPOLLOUT, deadline) != 0) {
+        return -1;
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(io->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+        return -1;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_CO_IO_H
+#define EPOLL_COROUTINE_CO_IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "coroutines.h"
+
+// 协程里使用的 fd。每个 fd 只在所属事件循环的 epoll 上注册一次（边缘触发，读写都关注），
+// 之后读写都不再 EPOLL_CTL_MOD。CO_IO_URING 的事件循环上 read/write/accept/close 走 io_uring，
+// 其他操作用到时才注册 epoll。
+// 以下函数都只能在协程里调用，deadline 为 co_now() 的时间，-1 表示不限时，超时返回 -1，errno 为 ETIMEDOUT
+struct co_io {
+    int fd;
+    struct co_event_loop *loop;
+    // 已经注册到 epoll 的事件，0 表示还没注册
+    uint32_t interest;
+    // 边缘触发下记录的就绪状态，系统调用返回 EAGAIN 或者读写不满时清掉
+    uint32_t ready;
+    // 流式 fd 读写不满说明缓冲区已经空了（满了），可以直接等下一次边缘
+    bool stream;
+    // 等待读写的协程，co 为 NULL 表示没有
+    struct co_future reader;
+    struct co_future writer;
+    struct co_uring_acceptor *acceptor;
+    // MSG_ZEROCOPY 的状态，以及已发送、已确认完成的 send 次数
+    uint8_t zerocopy;
+    uint32_t zc_sent;
+    uint32_t zc_done;
+};
+
+// 比这个小的数据用 MSG_ZEROCOPY 不划算，页面固定和完成通知的开销比拷贝大
+#define CO_ZEROCOPY_MIN (16 * 1024)
+
+// 把 fd 设成非阻塞并交给当前事件循环。fd 不能被 dup，否则 close 之后 epoll 里还留着注册
+int co_io_open(struct co_io *io, int fd);
+
+// 关闭 fd，co_io 本身可以随后释放
+int co_io_close(struct co_io *io);
+
+// co_teardown 之后释放 co_io 自己占用的资源，不关闭 fd
+void co_io_release(struct co_io *io);
+
+ssize_t co_read(struct co_io *io, void *buf, size_t count, int64_t deadline);
+
+// 写完全部数据才返回 count，出错返回 -1
+ssize_t co_write(struct co_io *io, const void *buf, size_t count, int64_t deadline);
+
+// 等到 fd 可读（或者对端关闭、出错）再返回，不读取数据。空闲的连接用它等待，不必先借缓冲区
+int co_wait_readable(struct co_io *io, int64_t deadline);
+
+ssize_t co_readv(struct co_io *io, const struct iovec *iov, int iovcnt, int64_t deadline);
+
+// 写完全部数据才返回，iov 会被修改为未写部分
+ssize_t co_writev(struct co_io *io, struct iovec *iov, int iovcnt, int64_t deadline);
+
+// 从 in_fd 发送 count 字节，offset 为 NULL 时使用并推进文件位置。读到文件结尾提前返回，返回已发送的字节数
+ssize_t co_sendfile(struct co_io *out, int in_fd, off_t *offset, size_t count, int64_t deadline);
+
+// 在 in 和 out 之间 splice 最多 len 字节，两者之一必须是管道，返回值同 splice。
+// socket 之间转发时中间接一个 co_io_open 过的管道
+ssize_t co_splice(struct co_io *in, struct co_io *out, size_t len, unsigned int flags, int64_t deadline);
+
+// 写完全部数据才返回。数据不小于 CO_ZEROCOPY_MIN 时使用 MSG_ZEROCOPY，
+// 并等到错误队列里的完成通知覆盖本次所有 send 之后再返回，返回后 buf 可以复用。
+// 不支持 SO_ZEROCOPY 或者内核实际做了拷贝（例如回环）时退回 co_write
+ssize_t co_send_zerocopy(struct co_io *io, const void *buf, size_t count, int64_t deadline);
+
+// 返回非阻塞的新 fd
+int co_accept(struct co_io *io, struct sockaddr *addr, socklen_t *addrlen, int64_t deadline);
+
+// 暂时不再接收 fd 上的事件：从 epoll 上摘掉，io_uring 模式下取消 multishot accept。
+// 监听 socket 暂停期间新连接留在内核的 backlog 里，不会再叫醒事件循环。暂停时不能有协程在等这个 fd
+int co_io_pause(struct co_io *io);
+
+// 重新注册，EPOLL_CTL_ADD 会立即报告暂停期间到达的事件
+int co_io_resume(struct co_io *io);
+
+// 给 co_select 用，event 为 EPOLLIN 或 EPOLLOUT。已经就绪返回 1，否则登记 future，就绪时叫醒它，返回 0，出错返回 -1
+int co_io_arm(struct co_io *io, uint32_t event, struct co_future future);
+
+// 撤销 co_io_arm，返回是否已经就绪
+bool co_io_disarm(struct co_io *io, uint32_t event, struct co_future future);
+
+int co_connect(struct co_io *io, const struct sockaddr *addr, socklen_t addrlen, int64_t deadline);
+
+// 事件循环内部使用：co_loop_wait 收到 data.u64 最低位为 1 的 epoll 事件时调用
+void co_io_on_event(uint64_t data, uint32_t events);
+
+#define CO_IO_EVENT_TAG 1
+
+#endif //EPOLL_COROUTINE_CO_IO_H
@@ -0,0 +1,113 @@
+//
+// Created by agent on 26-10-17.
+//
+#include "co_select.h"
+
+// handle.co 或者 io 为 NULL 的 case 永远不会完成
+static bool case_disabled(struct co_select_case *c) {
+    switch (c->kind) {
+        case CO_SELECT_JOIN:
+            return c->handle.co == NULL;
+        case CO_SELECT_READABLE:
+        case CO_SELECT_WRITABLE:
+            return c->io == NULL;
+        default:
+            return true;
+    }
+}
+
+static int arm_case(struct co_select_case *c, struct co_future future) {
+    if (case_disabled(c)) {
+        return 0;
+    }
+    switch (c->kind) {
+        case CO_SELECT_JOIN:
+            return co_join_arm(c->handle, future);
+        case CO_SELECT_READABLE:
+            return co_io_arm(c->io, EPOLLIN, future);
+        case CO_SELECT_WRITABLE:
+            return co_io_arm(c->io, EPOLLOUT, future);
+        default:
+            return 0;
+    }
+}
+
+static bool disarm_case(struct co_select_case *c, struct co_future future) {
+    if (case_disabled(c)) {
+        return false;
+    }
+    switch (c->kind) {
+        case CO_SELECT_JOIN:
+            return co_join_disarm(c->handle);
+        case CO_SELECT_READABLE:
+            return co_io_disarm(c->io, EPOLLIN, future);
+        case CO_SELECT_WRITABLE:
+            return co_io_disarm(c->io, EPOLLOUT, future);
+        default:
+            return false;
+    }
+}
+
+int co_select(struct co_select_case *cases, int n, int64_t deadline) {
+    if (n > CO_SELECT_MAX) {
+        return -2;
+    }
+    struct co_chan_case chan_cases[CO_SELECT_MAX];
+    int chan_index[CO_SELECT_MAX];
+    int chan_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (cases[i].kind == CO_SELECT_CHAN) {
+            chan_cases[chan_count] = cases[i].chan;
+            chan_index[chan_count] = i;
+            chan_count++;
+        }
+    }
+    // channel 的等待者在栈上，共享栈协程只能试一次
+    if (chan_count > 0 && co_current_on_shared_stack()) {
+        int index = co_chan_select(chan_cases, chan_count, 0);
+        if (index == -1) {
+            return -2;
+        }
+        cases[chan_index[index]].chan.ok = chan_cases[index].ok;
+        return chan_index[index];
+    }
+    struct co_future future = co_current_future();
+    struct co_chan_wait_set set;
+    // channel 先挂：马上能完成的已经搬了数据，直接返回
+    if (chan_count > 0) {
+        int index = co_chan_arm(&set, chan_cases, chan_count, future);
+        if (index != -1) {
+            cases[chan_index[index]].chan.ok = chan_cases[index].ok;
+            return chan_index[index];
+        }
+    }
+    int fired = -1;
+    int armed = 0;
+    while (armed < n && fired == -1) {
+        if (arm_case(&cases[armed], future) != 0) {
+            fired = armed;
+        }
+        armed++;
+    }
+    bool blocked = fired == -1;
+    if (blocked) {
+        co_block_until(deadline);
+    }
+    int chan_fired = chan_count > 0 ? co_chan_disarm(&set, chan_cases, chan_count) : -1;
+    for (int i = 0; i < armed; i++) {
+        if (disarm_case(&cases[i], future) && fired == -1) {
+            fired = i;
+        }
+    }
+    // 没有挂起时，别的线程可能已经抢到了这一代的唤醒并把协程挂进了 inbox，
+    // 直接返回之后再进就绪队列会覆盖链表指针，挂起一次把这个唤醒消化掉
+    if (!blocked && !co_future_pending(future)) {
+        co_block();
+    }
+    co_current_future();
+    if (chan_fired != -1) {
+        cases[chan_index[chan_fired]].chan.ok = chan_cases[chan_fired].ok;
+        return chan_index[chan_fired];
+    }
+    return fired;
+}
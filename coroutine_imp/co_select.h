@@ -0,0 +1,40 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_CO_SELECT_H
+#define EPOLL_COROUTINE_CO_SELECT_H
+
+#include <stdint.h>
+#include "coroutines.h"
+#include "co_io.h"
+#include "co_chan.h"
+
+#define CO_SELECT_MAX CO_CHAN_SELECT_MAX
+
+enum co_select_kind {
+    // 协程退出，之后 co_join 不会挂起
+    CO_SELECT_JOIN,
+    // fd 可读或者可写，之后读写不一定成功，要像边缘触发一样处理 EAGAIN
+    CO_SELECT_READABLE,
+    CO_SELECT_WRITABLE,
+    // channel 的收发，完成时数据已经搬好
+    CO_SELECT_CHAN,
+};
+
+// handle.co、io 或者 chan.chan 为 NULL 的 case 永远不会完成，可以用来关掉已经处理过的 case
+struct co_select_case {
+    enum co_select_kind kind;
+    struct co_handle handle;
+    struct co_io *io;
+    struct co_chan_case chan;
+};
+
+// 在同一个 future 上等多个事件，返回先完成的 case 的下标。channel 的 case 完成就意味着数据已经收发，
+// 同时有多个 case 满足时优先报告 channel，其余的下次还能看到。
+// 超时或者被取消返回 -1，case 超过 CO_SELECT_MAX 个返回 -2。
+// CO_STACK_SHARED 协程带 channel 的 case 时只检查一次 channel，都不能马上完成就返回 -2。
+// 句柄无效或者 fd 出错的 case 立即返回，由之后的 co_join、co_read 报告错误
+int co_select(struct co_select_case *cases, int n, int64_t deadline);
+
+#endif //EPOLL_COROUTINE_CO_SELECT_H
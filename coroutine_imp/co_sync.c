@@ -0,0 +1,300 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include "co_sync.h"
+
+#define LOCK_SPINS 64
+
+static void init_wait_queue(struct co_wait_queue *queue) {
+    atomic_flag_clear(&queue->lock);
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+// 持锁的线程被抢占时干等没有意义，转几圈还拿不到就让出 CPU
+void co_spin_lock(atomic_flag *lock) {
+    int spins = 0;
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+        if (++spins == LOCK_SPINS) {
+            spins = 0;
+            sched_yield();
+        }
+    }
+}
+
+void co_spin_unlock(atomic_flag *lock) {
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static void lock_queue(struct co_wait_queue *queue) {
+    co_spin_lock(&queue->lock);
+}
+
+static void unlock_queue(struct co_wait_queue *queue) {
+    co_spin_unlock(&queue->lock);
+}
+
+static void push_waiter(struct co_wait_queue *queue, struct co_wait_node *node) {
+    node->next = NULL;
+    node->queued = true;
+    if (queue->tail == NULL) {
+        queue->head = node;
+    } else {
+        queue->tail->next = node;
+    }
+    queue->tail = node;
+}
+
+// 持锁时把 future 拷出来。超时的协程一旦发现自己出队就可能开始新的等待，放锁之后不能再碰节点
+static bool pop_waiter(struct co_wait_queue *queue, struct co_future *future) {
+    struct co_wait_node *node = queue->head;
+    if (node == NULL) {
+        return false;
+    }
+    queue->head = node->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    *future = node->future;
+    node->next = NULL;
+    node->queued = false;
+    return true;
+}
+
+static bool remove_waiter(struct co_wait_queue *queue, struct co_wait_node *node) {
+    if (!node->queued) {
+        return false;
+    }
+    struct co_wait_node *prev = NULL;
+    for (struct co_wait_node *p = queue->head; p != node; p = p->next) {
+        prev = p;
+    }
+    if (prev == NULL) {
+        queue->head = node->next;
+    } else {
+        prev->next = node->next;
+    }
+    if (queue->tail == node) {
+        queue->tail = prev;
+    }
+    node->next = NULL;
+    node->queued = false;
+    return true;
+}
+
+// 超时或者被取消后还在队列里就自己摘掉；已经被摘走说明唤醒和超时撞在一起，按被唤醒处理
+static int finish_wait(struct co_wait_queue *queue, struct co_wait_node *node, int ret) {
+    if (ret == 0) {
+        return 0;
+    }
+    lock_queue(queue);
+    bool removed = remove_waiter(queue, node);
+    unlock_queue(queue);
+    return removed ? ret : 0;
+}
+
+// 只唤醒开始时已经在排队的协程，之后新来的不管
+static void wake_all(struct co_wait_queue *queue) {
+    lock_queue(queue);
+    int count = 0;
+    for (struct co_wait_node *node = queue->head; node != NULL; node = node->next) {
+        count++;
+    }
+    unlock_queue(queue);
+    struct co_future future;
+    for (; count > 0; count--) {
+        lock_queue(queue);
+        bool found = pop_waiter(queue, &future);
+        unlock_queue(queue);
+        if (!found) {
+            break;
+        }
+        co_wakeup_remote(future);
+    }
+}
+
+void co_mutex_init(struct co_mutex *mutex) {
+    atomic_init(&mutex->state, 0);
+    init_wait_queue(&mutex->waiters);
+}
+
+bool co_mutex_trylock(struct co_mutex *mutex) {
+    int expected = 0;
+    return atomic_compare_exchange_strong_explicit(&mutex->state, &expected, 1,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+void co_mutex_lock(struct co_mutex *mutex) {
+    if (co_mutex_trylock(mutex)) {
+        return;
+    }
+    struct co_wait_node *node = co_current_wait_node();
+    lock_queue(&mutex->waiters);
+    int state = atomic_load(&mutex->state);
+    while (true) {
+        if (state == 0) {
+            if (atomic_compare_exchange_weak(&mutex->state, &state, 1)) {
+                unlock_queue(&mutex->waiters);
+                return;
+            }
+            continue;
+        }
+        // 置成 2 之后解锁的协程一定会来看等待队列
+        if (state == 2 || atomic_compare_exchange_weak(&mutex->state, &state, 2)) {
+            break;
+        }
+    }
+    push_waiter(&mutex->waiters, node);
+    unlock_queue(&mutex->waiters);
+    co_block();
+}
+
+void co_mutex_unlock(struct co_mutex *mutex) {
+    int expected = 1;
+    if (atomic_compare_exchange_strong_explicit(&mutex->state, &expected, 0,
+                                                memory_order_release, memory_order_relaxed)) {
+        return;
+    }
+    struct co_future next;
+    lock_queue(&mutex->waiters);
+    if (!pop_waiter(&mutex->waiters, &next)) {
+        atomic_store(&mutex->state, 0);
+        unlock_queue(&mutex->waiters);
+        return;
+    }
+    // 锁直接交给队头，状态保持加锁
+    atomic_store(&mutex->state, mutex->waiters.head != NULL ? 2 : 1);
+    unlock_queue(&mutex->waiters);
+    co_wakeup_remote(next);
+}
+
+void co_cond_init(struct co_cond *cond) {
+    init_wait_queue(&cond->waiters);
+}
+
+int co_cond_wait(struct co_cond *cond, struct co_mutex *mutex, int64_t deadline) {
+    struct co_wait_node *node = co_current_wait_node();
+    lock_queue(&cond->waiters);
+    push_waiter(&cond->waiters, node);
+    unlock_queue(&cond->waiters);
+    // 先排队再解锁，解锁之后的 signal 不会丢
+    co_mutex_unlock(mutex);
+    int ret = finish_wait(&cond->waiters, node, co_block_until(deadline));
+    co_mutex_lock(mutex);
+    return ret;
+}
+
+void co_cond_signal(struct co_cond *cond) {
+    struct co_future future;
+    while (true) {
+        lock_queue(&cond->waiters);
+        bool found = pop_waiter(&cond->waiters, &future);
+        unlock_queue(&cond->waiters);
+        // 队头刚好超时的话再叫下一个
+        if (!found || co_wakeup_remote(future) == CO_SUCCESS) {
+            return;
+        }
+    }
+}
+
+void co_cond_broadcast(struct co_cond *cond) {
+    wake_all(&cond->waiters);
+}
+
+void co_sem_init(struct co_sem *sem, int64_t count) {
+    atomic_init(&sem->count, count);
+    atomic_init(&sem->waiting, 0);
+    init_wait_queue(&sem->waiters);
+}
+
+bool co_sem_try_acquire(struct co_sem *sem) {
+    int_fast64_t count = atomic_load(&sem->count);
+    while (count > 0) {
+        if (atomic_compare_exchange_weak(&sem->count, &count, count - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int co_sem_acquire(struct co_sem *sem, int64_t deadline) {
+    if (co_sem_try_acquire(sem)) {
+        return 0;
+    }
+    struct co_wait_node *node = co_current_wait_node();
+    lock_queue(&sem->waiters);
+    // 先登记再复查，和 co_sem_release 先加计数再看 waiting 配对，两边至少有一边看得到对方
+    atomic_fetch_add(&sem->waiting, 1);
+    if (co_sem_try_acquire(sem)) {
+        atomic_fetch_sub(&sem->waiting, 1);
+        unlock_queue(&sem->waiters);
+        return 0;
+    }
+    push_waiter(&sem->waiters, node);
+    unlock_queue(&sem->waiters);
+    int ret = finish_wait(&sem->waiters, node, co_block_until(deadline));
+    if (ret != 0) {
+        atomic_fetch_sub(&sem->waiting, 1);
+    }
+    return ret;
+}
+
+void co_sem_release(struct co_sem *sem) {
+    atomic_fetch_add(&sem->count, 1);
+    if (atomic_load(&sem->waiting) == 0) {
+        return;
+    }
+    struct co_future future;
+    while (true) {
+        lock_queue(&sem->waiters);
+        if (sem->waiters.head == NULL || !co_sem_try_acquire(sem)) {
+            unlock_queue(&sem->waiters);
+            return;
+        }
+        // 替队头拿走许可再叫醒它。唤醒失败说明它刚好超时，它会发现自己已经出队，当作拿到了许可
+        pop_waiter(&sem->waiters, &future);
+        atomic_fetch_sub(&sem->waiting, 1);
+        unlock_queue(&sem->waiters);
+        co_wakeup_remote(future);
+    }
+}
+
+void co_waitgroup_init(struct co_waitgroup *wg) {
+    atomic_init(&wg->count, 0);
+    init_wait_queue(&wg->waiters);
+}
+
+void co_waitgroup_add(struct co_waitgroup *wg, int64_t delta) {
+    int_fast64_t count = atomic_fetch_add(&wg->count, delta) + delta;
+    if (count < 0) {
+        printf("%s: negative counter\n", __func__);
+        abort();
+    }
+    if (count == 0 && delta != 0) {
+        wake_all(&wg->waiters);
+    }
+}
+
+void co_waitgroup_done(struct co_waitgroup *wg) {
+    co_waitgroup_add(wg, -1);
+}
+
+int co_waitgroup_wait(struct co_waitgroup *wg, int64_t deadline) {
+    if (atomic_load(&wg->count) == 0) {
+        return 0;
+    }
+    struct co_wait_node *node = co_current_wait_node();
+    lock_queue(&wg->waiters);
+    // 计数降到 0 的一方随后会来拿锁，持锁时还不是 0 就一定能被它看到
+    if (atomic_load(&wg->count) == 0) {
+        unlock_queue(&wg->waiters);
+        return 0;
+    }
+    push_waiter(&wg->waiters, node);
+    unlock_queue(&wg->waiters);
+    return finish_wait(&wg->waiters, node, co_block_until(deadline));
+}
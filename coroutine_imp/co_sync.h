@@ -0,0 +1,91 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_CO_SYNC_H
+#define EPOLL_COROUTINE_CO_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "coroutines.h"
+
+// 协程用的同步原语。等待队列先进先出，节点嵌在协程里，等待时不分配内存；
+// 没有竞争时只做一次原子操作，不进调度器。可以在不同事件循环的协程之间共享。
+// 会挂起的函数只能在协程里调用，deadline 为 co_now() 的时间，-1 表示不限时。
+// 带 deadline 的等待被 co_cancel 打断时返回 ECANCELED，co_mutex_lock 不会被打断
+
+// 只保护等待队列，临界区只有几条指令
+struct co_wait_queue {
+    atomic_flag lock;
+    struct co_wait_node *head;
+    struct co_wait_node *tail;
+};
+
+struct co_mutex {
+    // 0 未加锁，1 已加锁，2 已加锁并且可能有人在等
+    atomic_int state;
+    struct co_wait_queue waiters;
+};
+
+struct co_cond {
+    struct co_wait_queue waiters;
+};
+
+struct co_sem {
+    atomic_int_fast64_t count;
+    // 进了慢路径的协程数，释放时据此决定要不要看等待队列
+    atomic_int waiting;
+    struct co_wait_queue waiters;
+};
+
+struct co_waitgroup {
+    atomic_int_fast64_t count;
+    struct co_wait_queue waiters;
+};
+
+// 只用来保护几条指令的临界区，不能在持锁时挂起协程
+void co_spin_lock(atomic_flag *lock);
+
+void co_spin_unlock(atomic_flag *lock);
+
+void co_mutex_init(struct co_mutex *mutex);
+
+// 解锁时直接把锁交给队头的协程，不会被后来的协程抢走
+void co_mutex_lock(struct co_mutex *mutex);
+
+bool co_mutex_trylock(struct co_mutex *mutex);
+
+void co_mutex_unlock(struct co_mutex *mutex);
+
+void co_cond_init(struct co_cond *cond);
+
+// 调用时必须持有 mutex，返回时重新持有。被唤醒返回 0，超时返回 ETIMEDOUT。
+// 和 pthread 一样要在循环里检查条件
+int co_cond_wait(struct co_cond *cond, struct co_mutex *mutex, int64_t deadline);
+
+void co_cond_signal(struct co_cond *cond);
+
+void co_cond_broadcast(struct co_cond *cond);
+
+void co_sem_init(struct co_sem *sem, int64_t count);
+
+// 拿到一个许可返回 0，超时返回 ETIMEDOUT
+int co_sem_acquire(struct co_sem *sem, int64_t deadline);
+
+bool co_sem_try_acquire(struct co_sem *sem);
+
+// 有人在等时许可直接交给队头
+void co_sem_release(struct co_sem *sem);
+
+void co_waitgroup_init(struct co_waitgroup *wg);
+
+// 计数降到 0 时唤醒所有等待者，计数不能小于 0
+void co_waitgroup_add(struct co_waitgroup *wg, int64_t delta);
+
+void co_waitgroup_done(struct co_waitgroup *wg);
+
+// 计数为 0 返回 0，超时返回 ETIMEDOUT
+int co_waitgroup_wait(struct co_waitgroup *wg, int64_t deadline);
+
+#endif //EPOLL_COROUTINE_CO_SYNC_H
@@ -0,0 +1,120 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdint.h>
+#include "context.h"
+
+#if defined(__x86_64__)
+
+// 栈帧布局(低地址在前): mxcsr/x87 cw, r15, r14, r13, r12, rbx, rbp, 返回地址
+asm(".text\n"
+    ".globl co_context_swap\n"
+    ".type co_context_swap, @function\n"
+    "co_context_swap:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq (%rsi), %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size co_context_swap, .-co_context_swap\n"
+
+    ".type co_context_trampoline, @function\n"
+    "co_context_trampoline:\n"
+    ".cfi_startproc\n"
+    ".cfi_undefined rip\n"
+    "movq %r13, %rdi\n"
+    "call *%r12\n"
+    "ud2\n"
+    ".cfi_endproc\n"
+    ".size co_context_trampoline, .-co_context_trampoline\n");
+
+#define CONTEXT_FRAME_SLOTS 8
+
+#elif defined(__aarch64__)
+
+// 栈帧布局(低地址在前): x19-x30, d8-d15
+asm(".text\n"
+    ".globl co_context_swap\n"
+    ".type co_context_swap, %function\n"
+    "co_context_swap:\n"
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "ldr x9, [x1]\n"
+    "mov sp, x9\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".size co_context_swap, .-co_context_swap\n"
+
+    ".type co_context_trampoline, %function\n"
+    "co_context_trampoline:\n"
+    ".cfi_startproc\n"
+    ".cfi_undefined x30\n"
+    "mov x0, x20\n"
+    "blr x19\n"
+    "brk #0\n"
+    ".cfi_endproc\n"
+    ".size co_context_trampoline, .-co_context_trampoline\n");
+
+#define CONTEXT_FRAME_SLOTS 20
+
+#else
+#error "co_context_swap is only implemented for x86_64 and aarch64"
+#endif
+
+void co_context_trampoline(void);
+
+void co_context_init(struct co_context *ctx, void *stack_top, co_context_entry entry, void *arg) {
+    uintptr_t top = (uintptr_t) stack_top & ~(uintptr_t) 15;
+    uint64_t *frame = (uint64_t *) top - CONTEXT_FRAME_SLOTS;
+    for (int i = 0; i < CONTEXT_FRAME_SLOTS; i++) {
+        frame[i] = 0;
+    }
+#if defined(__x86_64__)
+    frame[0] = 0x1F80 | ((uint64_t) 0x037F << 32);  // mxcsr 与 x87 控制字的默认值
+    frame[3] = (uint64_t) arg;                      // r13
+    frame[4] = (uint64_t) entry;                    // r12
+    frame[7] = (uint64_t) co_context_trampoline;
+#elif defined(__aarch64__)
+    frame[0] = (uint64_t) entry;                    // x19
+    frame[1] = (uint64_t) arg;                      // x20
+    frame[11] = (uint64_t) co_context_trampoline;   // x30
+#endif
+    ctx->sp = frame;
+}
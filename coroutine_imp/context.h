@@ -0,0 +1,22 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_CONTEXT_H
+#define EPOLL_COROUTINE_CONTEXT_H
+
+#include <stddef.h>
+
+// 只保存 callee-saved 寄存器和栈指针，寄存器本身压在协程自己的栈上
+struct co_context {
+    void *sp;
+};
+
+typedef void (*co_context_entry)(void *);
+
+// 在 stack_top 下方构造初始栈帧，第一次切换进来时调用 entry(arg)
+void co_context_init(struct co_context *ctx, void *stack_top, co_context_entry entry, void *arg);
+
+void co_context_swap(struct co_context *from, struct co_context *to);
+
+#endif //EPOLL_COROUTINE_CONTEXT_H
@@ -1,303 +1,2073 @@
 //
 // Created by qxy on 24-7-10.
 //
-#include <sys/mman.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <setjmp.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include "coroutines.h"
 #include "heap.h"
+#include "wheel.h"
 #include "queue.h"
+#include "context.h"
+#include "stack.h"
+#include "deque.h"
+#include "uring.h"
+#include "slab.h"
+#include "co_io.h"
 
-#define STACK_SIZE (128 * 1024)
 #define NAME_LEN 32
+#define STACK_PAINT 0xCD
+#define SHARED_STACK_CLASS CO_STACK_1M
+#define RELAY_STACK_CLASS CO_STACK_32K
+#define INIT_FRAME_SIZE 256
+#define MAX_LOOPS 256
+#define DEFAULT_TIMER_TICK_NS 1000000
+// CO_CLOCK_CACHED 下每切换这么多次协程也刷新一次，避免一直 yield 的协程让定时器饿死
+#define CLOCK_REFRESH_MASK 63
+#define DEFAULT_URING_ENTRIES 256
+#define COROUTINE_SLAB_REGION 64
+#define BUFFER_SLAB_REGION 16
+// 连续从 run_next 取这么多次之后先取一次就绪队列，两个协程互相唤醒时不会饿死别人
+#define RUN_NEXT_LIMIT 16
+// 看门狗每隔 slice 的几分之一检查一次，检查间隔限制在这个范围里
+#define WATCHDOG_MIN_INTERVAL_NS (1000LL * 1000)
+#define WATCHDOG_MAX_INTERVAL_NS (100LL * 1000 * 1000)
+#define WATCHDOG_FRAMES 64
 
-static struct array_queue co_idle_queue = {0};
-static struct array_queue co_all_queue = {0};
-static struct quad_heap g_timer_heap = {0};
-static struct co_event_loop g_event_loop = {0};
+// 各优先级一轮里最多连续取几个，按 enum co_priority 的顺序
+static const uint32_t default_priority_weight[CO_PRIO_COUNT] = {
+        [CO_PRIO_NORMAL] = 4,
+        [CO_PRIO_LATENCY] = 8,
+        [CO_PRIO_BACKGROUND] = 1,
+};
+
+// 取就绪协程时先看高优先级
+static const enum co_priority priority_order[CO_PRIO_COUNT] = {
+        CO_PRIO_LATENCY,
+        CO_PRIO_NORMAL,
+        CO_PRIO_BACKGROUND,
+};
+
+// io_uring 完成事件的 user_data 低两位区分来源，其余位是对应的指针
+enum uring_tag {
+    URING_TAG_IGNORE = 0,
+    URING_TAG_OP = 1,
+    URING_TAG_ACCEPT = 2,
+    URING_TAG_POLL = 3,
+};
+#define URING_TAG_MASK 3
+
+// co_spawn_task 出来的协程退出后要留到 co_join 或 co_detach
+enum join_state {
+    // 没有句柄或者已经 detach，退出时直接回收
+    JOIN_NONE,
+    JOIN_RUNNING,
+    // 有协程在等，退出时叫醒 joiner
+    JOIN_WAITING,
+    JOIN_FINISHED,
+};
+
+static const size_t stack_class_size[CO_STACK_CLASS_COUNT] = {
+        [CO_STACK_8K] = 8 * 1024,
+        [CO_STACK_32K] = 32 * 1024,
+        [CO_STACK_128K] = 128 * 1024,
+        [CO_STACK_1M] = 1024 * 1024,
+        [CO_STACK_SHARED] = 0,
+};
+
+struct shared_stack {
+    char *top;
+    struct coroutine *occupant;
+    // 从共享栈切到另一个共享栈协程时，需要先跳到中转栈上再拷贝
+    struct co_context relay_ctx;
+    struct coroutine *relay_to;
+};
+
+// 就绪队列通过协程里的 ready_next 串起来，调度时只碰协程本身
+struct ready_list {
+    struct coroutine *head;
+    struct coroutine *tail;
+    uint32_t size;
+};
+
+// 调度器的全部状态都属于某个线程自己的 co_event_loop，线程之间不共享
+struct co_event_loop {
+    // 每个优先级一个就绪队列，按权重加权轮转。credit 是这一轮还能取的个数，都用完了再补满
+    struct ready_list ready[CO_PRIO_COUNT];
+    uint32_t ready_size;
+    uint32_t weight[CO_PRIO_COUNT];
+    uint32_t credit[CO_PRIO_COUNT];
+    // co_dispatch 一次最多运行这么久就回去 epoll_wait，0 表示不限
+    int64_t dispatch_budget_ns;
+    // 协程里刚被唤醒的协程，优先于就绪队列运行
+    struct coroutine *run_next;
+    uint32_t run_next_streak;
+    enum co_wakeup_order wakeup_order;
+    struct coroutine *main_co;
+    // 可迁移的 CO_PRIO_NORMAL 协程的就绪队列，空闲的事件循环会从这里偷
+    struct work_deque deque;
+    uint32_t tick;
+    struct coroutine *pending_ready;
+    struct coroutine *pending_exit;
+    struct coroutine *current_co;
+    struct array_queue idle_queue[CO_STACK_CLASS_COUNT];
+    struct array_queue all_queue;
+    enum co_timer_kind timer_kind;
+    struct quad_heap timer_heap;
+    struct timer_wheel timer_wheel;
+    // 缓存的 CLOCK_MONOTONIC，co_loop_wait 返回时刷新
+    enum co_clock_kind clock_kind;
+    int64_t now;
+    uint32_t clock_calls;
+    bool clock_fresh;
+    struct stack_pool stack_pool[CO_STACK_CLASS_COUNT];
+    struct shared_stack shared_stack;
+#ifdef CO_STACK_DEBUG
+    size_t stack_class_high_water[CO_STACK_CLASS_COUNT];
+#endif
+    enum co_error error;
+    // 在其他线程上退出的协程通过这里还给所属的事件循环
+    pthread_mutex_t remote_idle_lock;
+    struct coroutine *_Atomic remote_idle;
+    int registry_index;
+    pthread_t thread;
+    // 看门狗的信号在这里处理，不占协程的栈。线程原来已经有备用栈时为 NULL，沿用原来的
+    void *signal_stack;
+    // 每次切换加 2，最低位表示切到的不是主协程。只有本线程写，看门狗靠它判断协程有没有让出
+    _Atomic uint32_t switch_seq;
+    // 看门狗要求当前协程让出，co_maybe_yield 看到后让出一次
+    atomic_bool preempt;
+    // 被看门狗打断过，co_dispatch 要尽快回去取 I/O 事件
+    bool poll_soon;
+    // 看门狗线程自己的记录，持有 loop_registry_lock 读锁时访问
+    uint32_t watch_seq;
+    int64_t watch_since;
+    bool watch_reported;
+    // 发信号前写好，信号处理函数核对 switch_seq 没变才报告
+    _Atomic uint32_t watch_report_seq;
+    _Atomic int64_t watch_overrun_ns;
+    _Atomic int64_t overrun_count;
+    int64_t steal_count;
+    // 其他线程的唤醒先进 inbox，第一个入队的线程负责写 event_fd 叫醒 epoll_wait
+    struct coroutine *_Atomic inbox;
+    int event_fd;
+    int epoll_fd;
+    enum co_io_kind io_kind;
+    // CO_IO_URING 时 event_fd 和 epoll_fd 都由 io_uring 的 multishot poll 监听
+    struct uring ring;
+    bool epoll_pending;
+    // 协程对象从这里切，空闲的协程留在 idle_queue 里复用，co_teardown 时整体释放
+    struct slab co_slab;
+    struct slab buffer_pool;
+    struct co_slab *slabs;
+    // 接入控制用的负载：还没退出的协程数，在别的线程退出的协程也会减到这里
+    _Atomic int live_count;
+    int max_size;
+    uint32_t max_buffers;
+    // 等负载降下来的协程，同一时间只有一个
+    struct co_future load_waiter;
+    int load_percent;
+    // 等缓冲区的协程，先进先出，只在本线程进出
+    struct co_wait_node *buffer_waiters;
+    struct co_wait_node *buffer_waiters_tail;
+};
+
+struct co_slab {
+    struct slab slab;
+    struct co_slab *next;
+};
+
+static __thread struct co_event_loop *tls_loop = NULL;
+
+static pthread_rwlock_t loop_registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct co_event_loop *loop_registry[MAX_LOOPS];
+static _Atomic int loop_registry_size = 0;
+
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct co_watchdog_config watchdog_config;
+static pthread_t watchdog_thread;
+static bool watchdog_running = false;
+static atomic_bool watchdog_stop;
+
+struct coroutine {
+    struct co_context ctx;
+    void *stack;
+    ssize_t stack_size;
+    enum co_stack_class stack_class;
+#ifdef CO_STACK_DEBUG
+    size_t high_water;
+#endif
+    void *save_buf;
+    size_t save_size;
+    size_t save_cap;
+    char name[NAME_LEN];
+    enum coroutine_status status;
+    // owner 分配了协程和它的栈，loop 是协程当前所在的事件循环
+    struct co_event_loop *owner;
+    struct co_event_loop *loop;
+    bool migratable;
+    enum co_priority priority;
+    struct coroutine *remote_next;
+    coroutine_func func;
+    void *arg;
+    co_task_func task;
+    void *result;
+    // 每次 spawn 加一，句柄靠它识别协程对象是否已经被复用
+    uint32_t spawn_id;
+    _Atomic int join_state;
+    struct co_future joiner;
+    // co_cancel 先置位再读 interrupt_gen，co_block_until 先写 interrupt_gen 再检查标记，两边至少有一边看得到对方
+    atomic_bool cancelled;
+    // 正在进行的可打断等待的代数，奇数表示没有
+    _Atomic uint32_t interrupt_gen;
+    // 就绪队列和 inbox 的链接，同一时间只会在其中一个里
+    struct coroutine *ready_next;
+    // 等待的代数：偶数表示正在等这一代，唤醒时原子地加一，之后同一代的唤醒都会失败
+    _Atomic uint32_t wait_gen;
+    // 定时器对应的代数
+    uint32_t timer_gen;
+    // 等同步原语时挂进等待队列的节点
+    struct co_wait_node wait_node;
+    // 每个协程同时最多挂一个定时器，timer_loop 不为 NULL 表示定时器还没到期也没取消
+    struct co_event_loop *timer_loop;
+    struct wheel_node timer;
+    int64_t heap_index;
+    bool timed_out;
+    // 阻塞在 io_uring 请求上时，完成结果和绝对超时时间放在这里
+    int32_t uring_res;
+    struct __kernel_timespec uring_deadline;
+};
+
+struct co_future co_current_future() {
+    struct coroutine *co = tls_loop->current_co;
+    uint32_t gen = (atomic_load_explicit(&co->wait_gen, memory_order_relaxed) | 1) + 1;
+    atomic_store_explicit(&co->wait_gen, gen, memory_order_release);
+    return (struct co_future) {
+            .co = co,
+            .gen = gen,
+    };
+}
+
+struct co_wait_node *co_current_wait_node() {
+    struct co_wait_node *node = &tls_loop->current_co->wait_node;
+    node->next = NULL;
+    node->future = co_current_future();
+    node->queued = false;
+    return node;
+}
+
+bool co_current_on_shared_stack() {
+    return tls_loop->current_co->stack_class == CO_STACK_SHARED;
+}
+
+bool co_future_pending(struct co_future future) {
+    return future.co != NULL && atomic_load_explicit(&future.co->wait_gen, memory_order_acquire) == future.gen;
+}
+
+// 抢到这一代的唤醒权，成功之后由调用者负责把协程放进就绪队列
+static enum co_error claim_wakeup(struct coroutine *co, uint32_t gen) {
+    uint32_t expected = gen;
+    if ((gen & 1) == 0 && atomic_compare_exchange_strong_explicit(&co->wait_gen, &expected, gen | 1,
+                                                                  memory_order_acq_rel, memory_order_acquire)) {
+        return CO_SUCCESS;
+    }
+    return expected == (gen | 1) ? CO_ALREADY_READY : CO_STALE_FUTURE;
+}
+
+#ifdef CO_STACK_DEBUG
+
+// 栈从高地址向低地址增长，从栈底找第一个被改写过的字节
+static size_t stack_high_water(struct coroutine *co) {
+    const unsigned char *bottom = co->stack;
+    size_t untouched = 0;
+    while (untouched < (size_t) co->stack_size && bottom[untouched] == STACK_PAINT) {
+        untouched++;
+    }
+    return co->stack_size - untouched;
+}
+
+static void record_high_water(struct coroutine *co) {
+    co->high_water = stack_high_water(co);
+    size_t *class_high_water = &co->owner->stack_class_high_water[co->stack_class];
+    if (co->high_water > *class_high_water) {
+        *class_high_water = co->high_water;
+    }
+}
+
+#endif
+
+static int reserve_save_buf(struct coroutine *co, size_t size) {
+    // 按实际大小分配，挂起时保存区尽量小
+    if (co->save_cap >= size && co->save_cap <= size * 2) {
+        return 0;
+    }
+    void *buf = realloc(co->save_buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    co->save_buf = buf;
+    co->save_cap = size;
+    return 0;
+}
+
+static void shared_stack_save(struct shared_stack *shared, struct coroutine *co) {
+    size_t size = shared->top - (char *) co->ctx.sp;
+    if (reserve_save_buf(co, size) != 0) {
+        printf("%s: cannot save stack of %s\n", __func__, co->name);
+        abort();
+    }
+    memcpy(co->save_buf, co->ctx.sp, size);
+    co->save_size = size;
+}
+
+// 调用方不能运行在共享栈上
+static void shared_stack_load(struct shared_stack *shared, struct coroutine *co) {
+    struct coroutine *occupant = shared->occupant;
+    if (occupant != NULL) {
+        shared_stack_save(shared, occupant);
+    }
+    memcpy(shared->top - co->save_size, co->save_buf, co->save_size);
+    shared->occupant = co;
+}
+
+static _Noreturn void shared_stack_relay(void *arg) {
+    struct shared_stack *shared = arg;
+    while (true) {
+        struct coroutine *co = shared->relay_to;
+        shared_stack_load(shared, co);
+        co_context_swap(&shared->relay_ctx, &co->ctx);
+    }
+}
+
+static int init_shared_stack(struct co_event_loop *loop) {
+    struct shared_stack *shared = &loop->shared_stack;
+    if (shared->top != NULL) {
+        return 0;
+    }
+    struct stack_pool *stack_pool = &loop->stack_pool[SHARED_STACK_CLASS];
+    struct stack_pool *relay_pool = &loop->stack_pool[RELAY_STACK_CLASS];
+    void *stack = stack_pool_alloc(stack_pool);
+    if (stack == NULL) {
+        return -1;
+    }
+    void *relay_stack = stack_pool_alloc(relay_pool);
+    if (relay_stack == NULL) {
+        stack_pool_free(stack_pool, stack);
+        return -1;
+    }
+    shared->top = (char *) stack + stack_pool->stack_size;
+    shared->occupant = NULL;
+    co_context_init(&shared->relay_ctx, (char *) relay_stack + relay_pool->stack_size, shared_stack_relay, shared);
+    return 0;
+}
+
+// 可迁移的协程可能在另一个线程上恢复，切换之后必须重新读取线程局部变量
+static __attribute__((noinline)) struct co_event_loop *thread_loop() {
+    asm volatile("" ::: "memory");
+    return tls_loop;
+}
+
+static void push_ready(struct co_event_loop *loop, struct coroutine *co) {
+    // 定时器还挂在本线程上的协程不能被偷走，否则取消时会碰到别的线程的定时器。
+    // 偷走的协程在对方那里只按普通优先级排队，其他优先级的留在本地
+    if (co->migratable && co->priority == CO_PRIO_NORMAL && co->timer_loop == NULL &&
+        deque_push(&loop->deque, co)) {
+        return;
+    }
+    struct ready_list *list = &loop->ready[co->priority];
+    co->ready_next = NULL;
+    if (list->tail == NULL) {
+        list->head = co;
+    } else {
+        list->tail->ready_next = co;
+    }
+    list->tail = co;
+    list->size++;
+    loop->ready_size++;
+}
+
+static struct coroutine *pop_ready_list(struct co_event_loop *loop, enum co_priority priority) {
+    struct ready_list *list = &loop->ready[priority];
+    struct coroutine *co = list->head;
+    if (co == NULL) {
+        return NULL;
+    }
+    list->head = co->ready_next;
+    if (list->head == NULL) {
+        list->tail = NULL;
+    }
+    co->ready_next = NULL;
+    list->size--;
+    loop->ready_size--;
+    return co;
+}
+
+static struct coroutine *pop_priority(struct co_event_loop *loop, enum co_priority priority) {
+    if (priority != CO_PRIO_NORMAL) {
+        return pop_ready_list(loop, priority);
+    }
+    // 两个队列轮流取，避免一边一直有协程 yield 时饿死另一边
+    struct coroutine *co;
+    if (++loop->tick & 1) {
+        co = deque_steal(&loop->deque);
+        return co != NULL ? co : pop_ready_list(loop, priority);
+    }
+    co = pop_ready_list(loop, priority);
+    return co != NULL ? co : deque_steal(&loop->deque);
+}
+
+// 加权轮转：有协程并且还有额度的优先级里取最高的，全都用完之后补满额度再来一轮
+static struct coroutine *pop_queues(struct co_event_loop *loop) {
+    // 大多数时候只有普通优先级，不用记额度
+    if (loop->ready[CO_PRIO_LATENCY].size == 0 && loop->ready[CO_PRIO_BACKGROUND].size == 0) {
+        return pop_priority(loop, CO_PRIO_NORMAL);
+    }
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < CO_PRIO_COUNT; i++) {
+            enum co_priority priority = priority_order[i];
+            if (loop->credit[priority] == 0) {
+                continue;
+            }
+            struct coroutine *co = pop_priority(loop, priority);
+            if (co != NULL) {
+                loop->credit[priority]--;
+                return co;
+            }
+        }
+        memcpy(loop->credit, loop->weight, sizeof(loop->credit));
+    }
+    return NULL;
+}
+
+static struct coroutine *pop_ready(struct co_event_loop *loop) {
+    struct coroutine *co = loop->run_next;
+    if (co != NULL && loop->run_next_streak < RUN_NEXT_LIMIT) {
+        loop->run_next = NULL;
+        loop->run_next_streak++;
+        return co;
+    }
+    loop->run_next_streak = 0;
+    struct coroutine *queued = pop_queues(loop);
+    if (queued != NULL) {
+        return queued;
+    }
+    loop->run_next = NULL;
+    return co;
+}
+
+static uint32_t ready_count(struct co_event_loop *loop) {
+    return loop->ready_size + deque_size(&loop->deque) + (loop->run_next != NULL);
+}
+
+static bool load_below(struct co_event_loop *loop, int percent) {
+    int64_t live = atomic_load(&loop->live_count);
+    if (live * 100 > (int64_t) loop->max_size * percent) {
+        return false;
+    }
+    return loop->max_buffers == 0 || (int64_t) loop->buffer_pool.in_use * 100 <= (int64_t) loop->max_buffers * percent;
+}
+
+static void check_load_waiter(struct co_event_loop *loop) {
+    struct co_future waiter = loop->load_waiter;
+    if (waiter.co != NULL && load_below(loop, loop->load_percent)) {
+        loop->load_waiter.co = NULL;
+        co_wakeup(loop, waiter);
+    }
+}
+
+static void release_coroutine(struct co_event_loop *loop, struct coroutine *co) {
+    struct co_event_loop *owner = co->owner;
+    atomic_fetch_sub(&owner->live_count, 1);
+    if (owner == loop) {
+        push_queue(&loop->idle_queue[co->stack_class], co);
+        check_load_waiter(loop);
+        return;
+    }
+    pthread_mutex_lock(&owner->remote_idle_lock);
+    co->remote_next = owner->remote_idle;
+    owner->remote_idle = co;
+    pthread_mutex_unlock(&owner->remote_idle_lock);
+}
+
+// 已经切换到别的协程，退出的协程的栈不会再被用到，这时才能交给 joiner 回收
+static void exit_coroutine(struct co_event_loop *loop, struct coroutine *co) {
+    int state = atomic_exchange(&co->join_state, JOIN_FINISHED);
+    if (state == JOIN_NONE) {
+        release_coroutine(loop, co);
+    } else if (state == JOIN_WAITING) {
+        co_wakeup_remote(co->joiner);
+    }
+}
+
+// 上一个协程的寄存器保存好之后才能让它重新可见，否则可能被其他线程偷走时还没切换完
+static void finish_switch(struct co_event_loop *loop) {
+    if (loop->pending_ready != NULL) {
+        push_ready(loop, loop->pending_ready);
+        loop->pending_ready = NULL;
+    }
+    if (loop->pending_exit != NULL) {
+        exit_coroutine(loop, loop->pending_exit);
+        loop->pending_exit = NULL;
+    }
+}
+
+static void switch_to(struct co_event_loop *loop, struct coroutine *from, struct coroutine *to) {
+    struct shared_stack *shared = &loop->shared_stack;
+    loop->current_co = to;
+    uint32_t seq = atomic_load_explicit(&loop->switch_seq, memory_order_relaxed);
+    atomic_store_explicit(&loop->switch_seq, ((seq + 2) & ~1u) | (to != loop->main_co), memory_order_relaxed);
+    to->status = COROUTINE_STATUS_RUNNING;
+    if (to->stack_class == CO_STACK_SHARED && shared->occupant != to && from->stack_class == CO_STACK_SHARED) {
+        shared->relay_to = to;
+        co_context_swap(&from->ctx, &shared->relay_ctx);
+    } else {
+        if (to->stack_class == CO_STACK_SHARED && shared->occupant != to) {
+            shared_stack_load(shared, to);
+        }
+        co_context_swap(&from->ctx, &to->ctx);
+    }
+    finish_switch(thread_loop());
+}
+
+static _Noreturn void coroutine_main(void *arg) {
+    struct coroutine *co = arg;
+    finish_switch(thread_loop());
+    co->func(co->arg);
+    struct co_event_loop *loop = thread_loop();
+#ifdef CO_STACK_DEBUG
+    if (co->stack != NULL) {
+        record_high_water(co);
+    }
+#endif
+    co->status = COROUTINE_STATUS_IDLE;
+    loop->pending_exit = co;
+    if (loop->shared_stack.occupant == co) {
+        loop->shared_stack.occupant = NULL;
+    }
+    struct coroutine *next = pop_ready(loop);
+    if (next == NULL) {
+        printf("%s: no coroutine to run\n", __func__);
+        co_print_all_coroutine();
+        abort();
+    }
+    switch_to(loop, co, next);
+    abort();
+}
+
+
+static enum co_error init_coroutine(struct co_event_loop *loop, struct coroutine *co,
+                                   enum co_stack_class stack_class) {
+    struct stack_pool *pool = &loop->stack_pool[stack_class];
+    co->owner = loop;
+    co->loop = loop;
+    co->migratable = false;
+    co->remote_next = NULL;
+    co->timer_loop = NULL;
+    co->timer.linked = false;
+    co->heap_index = -1;
+    co->ctx.sp = NULL;
+    co->save_buf = NULL;
+    co->save_size = 0;
+    co->save_cap = 0;
+    co->stack_class = stack_class;
+    co->name[0] = '\0';
+    co->status = COROUTINE_STATUS_IDLE;
+    co->spawn_id = 0;
+    atomic_init(&co->join_state, JOIN_NONE);
+    atomic_init(&co->cancelled, false);
+    atomic_init(&co->interrupt_gen, 1);
+    if (stack_class == CO_STACK_SHARED) {
+        co->stack = NULL;
+        co->stack_size = 0;
+        return init_shared_stack(loop) == 0 ? CO_SUCCESS : CO_ALLOC_ERR;
+    }
+    co->stack = stack_pool_alloc(pool);
+    if (co->stack == NULL) {
+        return CO_ALLOC_ERR;
+    }
+    co->stack_size = (ssize_t) pool->stack_size;
+#ifdef CO_STACK_DEBUG
+    memset(co->stack, STACK_PAINT, co->stack_size);
+    co->high_water = 0;
+#endif
+    return CO_SUCCESS;
+}
+
+static void deinit_coroutine(struct coroutine *co) {
+    if (co->stack != NULL) {
+        stack_pool_free(&co->owner->stack_pool[co->stack_class], co->stack);
+    }
+    free(co->save_buf);
+    co->save_buf = NULL;
+    co->save_size = 0;
+    co->save_cap = 0;
+    co->stack = NULL;
+    co->stack_size = 0;
+    co->status = COROUTINE_STATUS_IDLE;
+}
+
+static void co_switch_context(struct co_event_loop *loop, struct coroutine *dst_co) {
+    struct coroutine *current_co = loop->current_co;
+    if (dst_co->ctx.sp == NULL) {
+        printf("context is null, name = %s\n", dst_co->name);
+        abort();
+    }
+    switch_to(loop, current_co, dst_co);
+}
+
+static void make_ready(struct co_event_loop *loop, struct coroutine *co) {
+    if (co == loop->current_co) {
+        // 还没切换出去就被唤醒了，co_block 看到 READY 会直接返回
+        co->status = COROUTINE_STATUS_READY;
+        return;
+    }
+    // 已经在就绪队列里（例如 yield 之后），不能再放一次
+    if (co->status == COROUTINE_STATUS_READY) {
+        return;
+    }
+    co->status = COROUTINE_STATUS_READY;
+    push_ready(loop, co);
+}
+
+// 已经抢到唤醒权，协程在本线程上
+static void wakeup_local(struct co_event_loop *loop, struct coroutine *co) {
+    // 只有协程之间的唤醒走 run_next，事件循环一次唤醒一批时仍然按顺序排队。
+    // 后台协程不插队
+    if (loop->wakeup_order == CO_WAKEUP_LIFO && loop == tls_loop && loop->current_co != loop->main_co &&
+        co != loop->current_co && co->status != COROUTINE_STATUS_READY && co->priority != CO_PRIO_BACKGROUND) {
+        co->status = COROUTINE_STATUS_READY;
+        if (loop->run_next != NULL) {
+            push_ready(loop, loop->run_next);
+        }
+        loop->run_next = co;
+        return;
+    }
+    make_ready(loop, co);
+}
+
+enum co_error co_wakeup(struct co_event_loop *loop, struct co_future future) {
+    struct coroutine *co = future.co;
+    if (loop == NULL || co == NULL) {
+        return CO_INVALID_ARG;
+    }
+    enum co_error ret = claim_wakeup(co, future.gen);
+    if (ret != CO_SUCCESS) {
+        return ret;
+    }
+    wakeup_local(loop, co);
+    return CO_SUCCESS;
+}
+
+enum co_error co_wakeup_remote(struct co_future future) {
+    struct coroutine *co = future.co;
+    if (co == NULL) {
+        return CO_INVALID_ARG;
+    }
+    enum co_error ret = claim_wakeup(co, future.gen);
+    if (ret != CO_SUCCESS) {
+        return ret;
+    }
+    struct co_event_loop *loop = co->loop;
+    if (loop == tls_loop) {
+        wakeup_local(loop, co);
+        return CO_SUCCESS;
+    }
+    struct coroutine *head = atomic_load_explicit(&loop->inbox, memory_order_relaxed);
+    do {
+        co->ready_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&loop->inbox, &head, co,
+                                                    memory_order_release, memory_order_relaxed));
+    // inbox 原来非空说明已经有人叫醒过了，一批唤醒只需要写一次
+    if (head == NULL) {
+        co_loop_notify(loop);
+    }
+    return CO_SUCCESS;
+}
+
+void co_loop_notify(struct co_event_loop *loop) {
+    uint64_t one = 1;
+    ssize_t ret;
+    do {
+        ret = write(loop->event_fd, &one, sizeof(one));
+    } while (ret == -1 && errno == EINTR);
+}
+
+static void drain_inbox(struct co_event_loop *loop) {
+    if (atomic_load_explicit(&loop->inbox, memory_order_relaxed) == NULL) {
+        return;
+    }
+    struct coroutine *co = atomic_exchange_explicit(&loop->inbox, NULL, memory_order_acquire);
+    // inbox 是后进先出的，反转之后按唤醒的顺序入队
+    struct coroutine *reversed = NULL;
+    while (co != NULL) {
+        struct coroutine *next = co->ready_next;
+        co->ready_next = reversed;
+        reversed = co;
+        co = next;
+    }
+    while (reversed != NULL) {
+        struct coroutine *next = reversed->ready_next;
+        reversed->ready_next = NULL;
+        // 唤醒送到之前协程已经开始了新的等待（例如先 yield 回来又挂起），这次唤醒作废
+        if (atomic_load_explicit(&reversed->wait_gen, memory_order_acquire) & 1) {
+            make_ready(loop, reversed);
+        }
+        reversed = next;
+    }
+}
+
+static int64_t read_clock(clockid_t clock_id) {
+    struct timespec now_spec;
+    clock_gettime(clock_id, &now_spec);
+    return now_spec.tv_sec * 1000000000 + now_spec.tv_nsec;
+}
+
+static void refresh_clock(struct co_event_loop *loop) {
+    int64_t now = read_clock(loop->clock_kind == CO_CLOCK_COARSE ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC);
+    // 粗粒度时钟可能落后于 co_now_precise 写进来的值
+    if (now > loop->now) {
+        loop->now = now;
+    }
+}
+
+static int64_t loop_now(struct co_event_loop *loop) {
+    if (loop->clock_kind == CO_CLOCK_PRECISE) {
+        refresh_clock(loop);
+    }
+    return loop->now;
+}
+
+int64_t co_now() {
+    if (tls_loop == NULL) {
+        return read_clock(CLOCK_MONOTONIC);
+    }
+    return loop_now(tls_loop);
+}
+
+int64_t co_now_precise() {
+    int64_t now = read_clock(CLOCK_MONOTONIC);
+    if (tls_loop != NULL && now > tls_loop->now) {
+        tls_loop->now = now;
+    }
+    return now;
+}
+
+// 堆扩容失败返回 -1，这时没有挂上定时器
+static int add_timer(struct co_event_loop *loop, struct coroutine *co, int64_t expire) {
+    co->timer_gen = atomic_load_explicit(&co->wait_gen, memory_order_relaxed);
+    if (loop->timer_kind == CO_TIMER_WHEEL) {
+        wheel_add(&loop->timer_wheel, &co->timer, expire, co);
+    } else {
+        co->heap_index = -1;
+        if (heap_push(&loop->timer_heap, (quad_heap_node) {expire, co, &co->heap_index}) != 0) {
+            return -1;
+        }
+    }
+    co->timer_loop = loop;
+    return 0;
+}
+
+static void cancel_timer(struct coroutine *co) {
+    struct co_event_loop *loop = co->timer_loop;
+    if (loop == NULL) {
+        return;
+    }
+    if (loop->timer_kind == CO_TIMER_WHEEL) {
+        wheel_remove(&loop->timer_wheel, &co->timer);
+    } else {
+        heap_remove(&loop->timer_heap, co->heap_index);
+    }
+    co->timer_loop = NULL;
+}
+
+static void fire_timer(struct co_event_loop *loop, struct coroutine *co) {
+    co->timer_loop = NULL;
+    // 已经被 I/O 或其他线程先唤醒了，定时器只是来晚了
+    if (claim_wakeup(co, co->timer_gen) != CO_SUCCESS) {
+        return;
+    }
+    co->timed_out = true;
+    make_ready(loop, co);
+}
+
+static void proc_timer_event(struct co_event_loop *loop) {
+    if (loop->clock_kind == CO_CLOCK_COARSE ||
+        (loop->clock_kind == CO_CLOCK_CACHED && (++loop->clock_calls & CLOCK_REFRESH_MASK) == 0)) {
+        refresh_clock(loop);
+    }
+    int64_t now = loop_now(loop);
+    if (loop->timer_kind == CO_TIMER_WHEEL) {
+        // 同一个 tick 到期的定时器一次性摘下来
+        struct wheel_node *node = wheel_expire(&loop->timer_wheel, now);
+        while (node != NULL) {
+            struct wheel_node *next = node->next;
+            node->next = NULL;
+            fire_timer(loop, node->data);
+            node = next;
+        }
+        return;
+    }
+    while (!heap_empty(&loop->timer_heap) && loop->timer_heap.nodes[0].key <= now) {
+        fire_timer(loop, heap_pop(&loop->timer_heap).data);
+    }
+}
+
+static bool yield_current(struct co_event_loop *loop) {
+    struct coroutine *co = loop->current_co;
+    proc_timer_event(loop);
+    struct coroutine *next = pop_ready(loop);
+    if (next == NULL) {
+        return false;
+    }
+    co->status = COROUTINE_STATUS_READY;
+    loop->pending_ready = co;
+    co_switch_context(loop, next);
+    return true;
+}
+
+void co_yield() {
+    if (!yield_current(tls_loop)) {
+        printf("%s: no coroutine to run\n", __func__);
+    }
+}
+
+void co_block() {
+    struct co_event_loop *loop = tls_loop;
+    struct coroutine *co = loop->current_co;
+    proc_timer_event(loop);
+    if (co->status == COROUTINE_STATUS_READY) {
+        co->status = COROUTINE_STATUS_RUNNING;
+        return;
+    }
+    struct coroutine *next = pop_ready(loop);
+    if (next == NULL) {
+        printf("%s: no coroutine to run\n", __func__);
+        abort();
+    }
+    co->status = COROUTINE_STATUS_BLOCKED;
+    co_switch_context(loop, next);
+}
+
+int co_block_until(int64_t deadline) {
+    struct co_event_loop *loop = tls_loop;
+    struct coroutine *co = loop->current_co;
+    uint32_t gen = atomic_load_explicit(&co->wait_gen, memory_order_relaxed);
+    atomic_store(&co->interrupt_gen, gen);
+    // 已经取消了就不挂起。自己抢掉这一代，之后迟到的唤醒都会失败；抢不到说明已经被唤醒了，照常挂起消化掉它
+    if (atomic_load(&co->cancelled) && claim_wakeup(co, gen) == CO_SUCCESS) {
+        return ECANCELED;
+    }
+    co->timed_out = false;
+    // 挂不上定时器就不能等，否则可能永远醒不过来。和取消一样先抢掉这一代，抢不到说明已经被唤醒，不需要定时器
+    if (deadline != -1 && add_timer(loop, co, deadline) != 0 && claim_wakeup(co, gen) == CO_SUCCESS) {
+        return ENOMEM;
+    }
+    co_block();
+    cancel_timer(co);
+    if (atomic_load(&co->cancelled)) {
+        return ECANCELED;
+    }
+    return co->timed_out ? ETIMEDOUT : 0;
+}
+
+int co_sleep(int64_t ns) {
+    co_current_future();
+    // 缓存的时钟可能落后一整轮调度，按它算会提前醒
+    int ret = co_block_until(co_now_precise() + ns);
+    if (ret == ETIMEDOUT) {
+        return 0;
+    }
+    return ret == 0 ? EINTR : ret;
+}
+
+static void reclaim_remote_idle(struct co_event_loop *loop) {
+    pthread_mutex_lock(&loop->remote_idle_lock);
+    struct coroutine *co = loop->remote_idle;
+    loop->remote_idle = NULL;
+    pthread_mutex_unlock(&loop->remote_idle_lock);
+    while (co != NULL) {
+        struct coroutine *next = co->remote_next;
+        co->remote_next = NULL;
+        push_queue(&loop->idle_queue[co->stack_class], co);
+        co = next;
+    }
+}
+
+static struct coroutine *get_idle_coroutine(struct co_event_loop *loop, enum co_stack_class stack_class) {
+    if (queue_size(&loop->idle_queue[stack_class]) == 0 && loop->remote_idle != NULL) {
+        reclaim_remote_idle(loop);
+    }
+    struct coroutine *co = pop_queue(&loop->idle_queue[stack_class]);
+    if (co != NULL) {
+#ifdef CO_STACK_DEBUG
+        // 只有上次用过的部分需要重新涂色
+        if (co->stack != NULL) {
+            memset((char *) co->stack + co->stack_size - co->high_water, STACK_PAINT, co->high_water);
+            co->high_water = 0;
+        }
+#endif
+        return co;
+    }
+    // all_queue 里还有主协程
+    if ((int64_t) queue_size(&loop->all_queue) > loop->max_size) {
+        loop->error = CO_QUEUE_FULL;
+        return NULL;
+    }
+    co = slab_alloc(&loop->co_slab);
+    if (co == NULL) {
+        loop->error = CO_ALLOC_ERR;
+        return NULL;
+    }
+    enum co_error ret = init_coroutine(loop, co, stack_class);
+    if (ret != 0) {
+        loop->error = ret;
+        slab_free(&loop->co_slab, co);
+        return NULL;
+    }
+    push_queue(&loop->all_queue, co);
+    return co;
+}
+
+enum co_error co_spawn(struct co_event_loop *loop, coroutine_func func, void *arg, char *name) {
+    return co_spawn_stack(loop, func, arg, name, CO_STACK_128K);
+}
+
+enum co_error co_spawn_stack(struct co_event_loop *loop, coroutine_func func, void *arg, char *name,
+                             enum co_stack_class stack_class) {
+    struct co_spawn_attr attr = {
+            .stack_class = stack_class,
+            .migratable = false,
+            .priority = CO_PRIO_NORMAL,
+    };
+    return co_spawn_with(loop, func, arg, name, &attr);
+}
+
+static enum co_error spawn_coroutine(struct co_event_loop *loop, coroutine_func func, void *arg, char *name,
+                                     const struct co_spawn_attr *attr, co_task_func task,
+                                     struct co_handle *handle) {
+    enum co_stack_class stack_class = attr->stack_class;
+    if (stack_class < 0 || stack_class >= CO_STACK_CLASS_COUNT ||
+        attr->priority < 0 || attr->priority >= CO_PRIO_COUNT) {
+        return CO_INVALID_ARG;
+    }
+    struct coroutine *co = get_idle_coroutine(loop, stack_class);
+    if (co == NULL) {
+        enum co_error ret = loop->error;
+        loop->error = CO_SUCCESS;
+        return ret;
+    }
+    strncpy(co->name, name, NAME_LEN);
+    co->func = func;
+    co->arg = arg;
+    co->task = task;
+    co->result = NULL;
+    co->loop = loop;
+    // 共享栈上的地址只在本线程有效，不能迁移
+    co->migratable = attr->migratable && stack_class != CO_STACK_SHARED;
+    co->priority = attr->priority;
+    if (stack_class == CO_STACK_SHARED) {
+        // 初始栈帧先构造在保存区里，第一次切换进来时再拷贝到共享栈上
+        _Alignas(16) char frame[INIT_FRAME_SIZE];
+        struct co_context ctx;
+        co_context_init(&ctx, frame + INIT_FRAME_SIZE, coroutine_main, co);
+        size_t size = frame + INIT_FRAME_SIZE - (char *) ctx.sp;
+        if (reserve_save_buf(co, size) != 0) {
+            co->status = COROUTINE_STATUS_IDLE;
+            push_queue(&loop->idle_queue[stack_class], co);
+            return CO_ALLOC_ERR;
+        }
+        memcpy(co->save_buf, ctx.sp, size);
+        co->save_size = size;
+        co->ctx.sp = loop->shared_stack.top - size;
+    } else {
+        co_context_init(&co->ctx, co->stack + co->stack_size, coroutine_main, co);
+    }
+    co->status = COROUTINE_STATUS_READY;
+    // 上一次使用时发出的句柄全部作废
+    atomic_fetch_or_explicit(&co->wait_gen, 1, memory_order_relaxed);
+    co->spawn_id++;
+    atomic_store(&co->join_state, handle != NULL ? JOIN_RUNNING : JOIN_NONE);
+    atomic_store(&co->cancelled, false);
+    atomic_store(&co->interrupt_gen, 1);
+    if (handle != NULL) {
+        handle->co = co;
+        handle->id = co->spawn_id;
+    }
+    atomic_fetch_add(&loop->live_count, 1);
+    push_ready(loop, co);
+    return CO_SUCCESS;
+}
+
+enum co_error co_spawn_with(struct co_event_loop *loop, coroutine_func func, void *arg, char *name,
+                            const struct co_spawn_attr *attr) {
+    return spawn_coroutine(loop, func, arg, name, attr, NULL, NULL);
+}
+
+static void run_task(void *arg) {
+    struct coroutine *co = thread_loop()->current_co;
+    co->result = co->task(arg);
+}
+
+enum co_error co_spawn_task(struct co_event_loop *loop, co_task_func func, void *arg, char *name,
+                            const struct co_spawn_attr *attr, struct co_handle *handle) {
+    if (handle == NULL) {
+        return CO_INVALID_ARG;
+    }
+    return spawn_coroutine(loop, run_task, arg, name, attr, func, handle);
+}
+
+static struct coroutine *handle_coroutine(struct co_handle handle) {
+    if (handle.co == NULL || handle.co->spawn_id != handle.id) {
+        return NULL;
+    }
+    return handle.co;
+}
+
+int co_join_arm(struct co_handle handle, struct co_future future) {
+    struct coroutine *co = handle_coroutine(handle);
+    if (co == NULL) {
+        return -1;
+    }
+    if (atomic_load(&co->join_state) == JOIN_FINISHED) {
+        return 1;
+    }
+    // 先写好 joiner 再发布，退出的一方看到 JOIN_WAITING 时一定能读到它
+    co->joiner = future;
+    int expected = JOIN_RUNNING;
+    if (atomic_compare_exchange_strong(&co->join_state, &expected, JOIN_WAITING)) {
+        return 0;
+    }
+    return expected == JOIN_FINISHED ? 1 : -1;
+}
+
+bool co_join_disarm(struct co_handle handle) {
+    struct coroutine *co = handle_coroutine(handle);
+    if (co == NULL) {
+        return false;
+    }
+    int expected = JOIN_WAITING;
+    if (atomic_compare_exchange_strong(&co->join_state, &expected, JOIN_RUNNING)) {
+        return false;
+    }
+    return expected == JOIN_FINISHED;
+}
+
+int co_join(struct co_handle handle, void **result, int64_t deadline) {
+    struct coroutine *co = handle_coroutine(handle);
+    int ret = co_join_arm(handle, co_current_future());
+    if (ret == -1) {
+        return EINVAL;
+    }
+    if (ret == 0) {
+        ret = co_block_until(deadline);
+        // 超时或者被取消的同时对方也可能刚好退出，撤销失败就按退出处理
+        if (ret != 0 && !co_join_disarm(handle)) {
+            return ret;
+        }
+    }
+    if (result != NULL) {
+        *result = co->result;
+    }
+    atomic_store(&co->join_state, JOIN_NONE);
+    // 可迁移的 joiner 醒来时可能已经换了线程
+    release_coroutine(thread_loop(), co);
+    return 0;
+}
+
+void co_detach(struct co_handle handle) {
+    struct coroutine *co = handle_coroutine(handle);
+    if (co != NULL && atomic_exchange(&co->join_state, JOIN_NONE) == JOIN_FINISHED) {
+        release_coroutine(thread_loop(), co);
+    }
+}
+
+enum co_error co_cancel(struct co_handle handle) {
+    struct coroutine *co = handle_coroutine(handle);
+    if (co == NULL) {
+        return CO_INVALID_ARG;
+    }
+    atomic_store(&co->cancelled, true);
+    // 只有可打断的等待用的那一代会被叫醒，co_block 的等待和已经结束的等待都不受影响
+    struct co_future future = {
+            .co = co,
+            .gen = atomic_load(&co->interrupt_gen),
+    };
+    co_wakeup_remote(future);
+    return CO_SUCCESS;
+}
+
+bool co_cancelled() {
+    return atomic_load(&tls_loop->current_co->cancelled);
+}
+
+enum co_error co_set_priority(enum co_priority priority) {
+    if (priority < 0 || priority >= CO_PRIO_COUNT) {
+        return CO_INVALID_ARG;
+    }
+    // 当前协程不在任何就绪队列里，下次排队时生效
+    tls_loop->current_co->priority = priority;
+    return CO_SUCCESS;
+}
+
+void co_pin() {
+    tls_loop->current_co->migratable = false;
+}
+
+static bool steal_ready(struct co_event_loop *loop) {
+    if (loop_registry_size < 2) {
+        return false;
+    }
+    struct coroutine *co = NULL;
+    pthread_rwlock_rdlock(&loop_registry_lock);
+    int size = loop_registry_size;
+    for (int i = 1; i < size && co == NULL; i++) {
+        struct co_event_loop *victim = loop_registry[(loop->registry_index + i) % size];
+        if (victim != loop) {
+            co = deque_steal(&victim->deque);
+        }
+    }
+    pthread_rwlock_unlock(&loop_registry_lock);
+    if (co == NULL) {
+        return false;
+    }
+    co->loop = loop;
+    loop->steal_count++;
+    push_ready(loop, co);
+    return true;
+}
+
+int co_dispatch(struct co_event_loop *loop) {
+    drain_inbox(loop);
+    // 不经过 co_loop_wait 直接调度时，每轮自己刷新一次时钟
+    if (!loop->clock_fresh) {
+        refresh_clock(loop);
+    }
+    loop->clock_fresh = false;
+    proc_timer_event(loop);
+    // 预算按真实时间算，不受 co_config.clock 的精度影响
+    loop->poll_soon = false;
+    int64_t budget_end = -1;
+    if (loop->dispatch_budget_ns > 0) {
+        budget_end = read_clock(CLOCK_MONOTONIC) + loop->dispatch_budget_ns;
+    }
+    // 本地没有就绪的协程时，先去其他事件循环偷，再回到 epoll_wait
+    while (ready_count(loop) > 0 || steal_ready(loop)) {
+        // 队列里的协程可能刚被其他线程偷走，这时什么也不做
+        yield_current(loop);
+        // 主协程和普通协程一起轮转，每轮回来一次看预算和看门狗。剩下的协程留到下一轮，co_loop_wait 不会阻塞
+        if (loop->poll_soon || (budget_end != -1 && read_clock(CLOCK_MONOTONIC) >= budget_end)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int64_t co_steal_count(struct co_event_loop *loop) {
+    return loop->steal_count;
+}
+
+bool co_maybe_yield() {
+    struct co_event_loop *loop = tls_loop;
+    if (!atomic_load_explicit(&loop->preempt, memory_order_relaxed)) {
+        return false;
+    }
+    atomic_store_explicit(&loop->preempt, false, memory_order_relaxed);
+    // 缓存的时钟可能已经停了很久，先刷新，到期的定时器才能跟着运行
+    refresh_clock(loop);
+    loop->poll_soon = true;
+    return yield_current(loop);
+}
+
+// 被打断的代码可能正在 malloc 或者 stdio 里，信号处理函数里只能手工拼字符串
+static size_t append_str(char *buf, size_t pos, size_t size, const char *s, size_t max) {
+    for (size_t i = 0; i < max && s[i] != '\0' && pos < size; i++) {
+        buf[pos++] = s[i];
+    }
+    return pos;
+}
 
-struct coroutine {
-    void *jmp_env;
-    void *stack;
-    ssize_t stack_size;
-    char name[NAME_LEN];
-    enum coroutine_status status;
-};
+static size_t append_int(char *buf, size_t pos, size_t size, int64_t value) {
+    char digits[24];
+    int n = 0;
+    uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+    do {
+        digits[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    if (value < 0 && pos < size) {
+        buf[pos++] = '-';
+    }
+    while (n > 0 && pos < size) {
+        buf[pos++] = digits[--n];
+    }
+    return pos;
+}
 
-struct co_future co_new_future() {
-    struct co_future future = {
-            .co = g_event_loop.current_co,
-            .ready = false,
+// 在超时的协程所在的线程上、备用信号栈上运行，backtrace 仍然能沿着协程的栈往回找。
+// backtrace 需要的 libgcc 在 co_watchdog_start 里已经加载，backtrace_symbols_fd 不分配内存。
+// 但 backtrace 仍然不是异步信号安全的：展开时要拿 dl_iterate_phdr 的锁，
+// 被打断的线程正好在 dlopen 或者自己展开栈（例如 C++ 异常）时会死锁，所以只在配置打开时调用
+static void watchdog_handler(int sig) {
+    (void) sig;
+    struct co_event_loop *loop = tls_loop;
+    if (loop == NULL ||
+        atomic_load_explicit(&loop->switch_seq, memory_order_relaxed) != atomic_load(&loop->watch_report_seq)) {
+        return;
+    }
+    int saved_errno = errno;
+    char msg[NAME_LEN + 96];
+    size_t len = append_str(msg, 0, sizeof(msg), "watchdog: coroutine ", SIZE_MAX);
+    len = append_str(msg, len, sizeof(msg), loop->current_co->name, NAME_LEN);
+    len = append_str(msg, len, sizeof(msg), " on loop ", SIZE_MAX);
+    len = append_int(msg, len, sizeof(msg), loop->registry_index);
+    len = append_str(msg, len, sizeof(msg), " ran ", SIZE_MAX);
+    len = append_int(msg, len, sizeof(msg), atomic_load(&loop->watch_overrun_ns) / 1000000);
+    len = append_str(msg, len, sizeof(msg), " ms without yielding\n", SIZE_MAX);
+    write(STDERR_FILENO, msg, len);
+    if (watchdog_config.backtrace) {
+        void *frames[WATCHDOG_FRAMES];
+        int n = backtrace(frames, WATCHDOG_FRAMES);
+        backtrace_symbols_fd(frames, n, STDERR_FILENO);
+    }
+    errno = saved_errno;
+}
+
+static void watch_loop(struct co_event_loop *loop, int64_t now) {
+    uint32_t seq = atomic_load_explicit(&loop->switch_seq, memory_order_relaxed);
+    if (seq != loop->watch_seq || loop->watch_since == 0) {
+        loop->watch_seq = seq;
+        loop->watch_since = now;
+        loop->watch_reported = false;
+        return;
+    }
+    // 主协程在 epoll_wait 或者调度，不算
+    if (!(seq & 1) || loop->watch_reported || now - loop->watch_since < watchdog_config.slice_ns) {
+        return;
+    }
+    loop->watch_reported = true;
+    atomic_fetch_add(&loop->overrun_count, 1);
+    if (watchdog_config.preempt) {
+        atomic_store_explicit(&loop->preempt, true, memory_order_relaxed);
+    }
+    atomic_store(&loop->watch_overrun_ns, now - loop->watch_since);
+    atomic_store(&loop->watch_report_seq, seq);
+    pthread_kill(loop->thread, watchdog_config.signal);
+}
+
+static void *watchdog_main(void *arg) {
+    (void) arg;
+    int64_t interval = watchdog_config.slice_ns / 4;
+    if (interval < WATCHDOG_MIN_INTERVAL_NS) {
+        interval = WATCHDOG_MIN_INTERVAL_NS;
+    } else if (interval > WATCHDOG_MAX_INTERVAL_NS) {
+        interval = WATCHDOG_MAX_INTERVAL_NS;
+    }
+    struct timespec ts = {
+            .tv_sec = interval / 1000000000,
+            .tv_nsec = interval % 1000000000,
     };
-    return future;
+    while (!atomic_load(&watchdog_stop)) {
+        nanosleep(&ts, NULL);
+        int64_t now = read_clock(CLOCK_MONOTONIC);
+        // 持有读锁期间事件循环没法注销，线程一定还在
+        pthread_rwlock_rdlock(&loop_registry_lock);
+        for (int i = 0; i < loop_registry_size; i++) {
+            watch_loop(loop_registry[i], now);
+        }
+        pthread_rwlock_unlock(&loop_registry_lock);
+    }
+    return NULL;
+}
+
+int co_watchdog_start(const struct co_watchdog_config *config) {
+    if (config->slice_ns <= 0 || config->signal < 0 || config->signal >= NSIG) {
+        return EINVAL;
+    }
+    pthread_mutex_lock(&watchdog_lock);
+    if (watchdog_running) {
+        pthread_mutex_unlock(&watchdog_lock);
+        return EBUSY;
+    }
+    watchdog_config = *config;
+    if (watchdog_config.signal == 0) {
+        watchdog_config.signal = SIGURG;
+    }
+    // 第一次调用会加载 libgcc，要分配内存，不能留到信号处理函数里
+    void *frame;
+    backtrace(&frame, 1);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watchdog_handler;
+    // 协程栈可能比信号帧还小，只能在 co_setup 准备好的备用栈上处理
+    action.sa_flags = SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(watchdog_config.signal, &action, NULL) != 0) {
+        int ret = errno;
+        pthread_mutex_unlock(&watchdog_lock);
+        return ret;
+    }
+    atomic_store(&watchdog_stop, false);
+    int ret = pthread_create(&watchdog_thread, NULL, watchdog_main, NULL);
+    watchdog_running = ret == 0;
+    pthread_mutex_unlock(&watchdog_lock);
+    return ret;
+}
+
+void co_watchdog_stop() {
+    pthread_mutex_lock(&watchdog_lock);
+    if (watchdog_running) {
+        atomic_store(&watchdog_stop, true);
+        pthread_join(watchdog_thread, NULL);
+        watchdog_running = false;
+    }
+    pthread_mutex_unlock(&watchdog_lock);
 }
 
-static enum co_error g_error = CO_SUCCESS;
+int64_t co_overrun_count(struct co_event_loop *loop) {
+    return atomic_load(&loop->overrun_count);
+}
 
-__attribute__((unused)) _Noreturn
-void coroutine_executor(coroutine_func func, void *arg, void *env) {
-    struct coroutine *co = g_event_loop.current_co;
-    jmp_buf my_env;
-    if (setjmp(my_env) == 0) {
-        struct co_future current_future = co_new_future();
-        push_queue(g_event_loop.ready_queue, &current_future);
-        co->jmp_env = my_env;
-        longjmp(env, 1);
+static void register_loop(struct co_event_loop *loop) {
+    pthread_rwlock_wrlock(&loop_registry_lock);
+    loop->registry_index = loop_registry_size;
+    if (loop_registry_size < MAX_LOOPS) {
+        loop_registry[loop_registry_size] = loop;
+        loop_registry_size++;
     }
-    func(arg);
-    co->status = COROUTINE_STATUS_IDLE;
-    push_queue(&co_idle_queue, co);
-    struct co_future *dst_future = pop_queue(g_event_loop.ready_queue);
-    if (dst_future == NULL) {
-        printf("%s: no coroutine to run\n", __func__);
-        co_print_all_coroutine();
-        abort();
+    pthread_rwlock_unlock(&loop_registry_lock);
+}
+
+static void unregister_loop(struct co_event_loop *loop) {
+    pthread_rwlock_wrlock(&loop_registry_lock);
+    for (int i = 0; i < loop_registry_size; i++) {
+        if (loop_registry[i] == loop) {
+            loop_registry[i] = loop_registry[loop_registry_size - 1];
+            loop_registry[i]->registry_index = i;
+            loop_registry_size--;
+            break;
+        }
     }
-    longjmp(dst_future->co->jmp_env, 1);
+    pthread_rwlock_unlock(&loop_registry_lock);
 }
 
-asm(".text\n"
-    "prepare_stack_switch:\n"
-    "movq %rsp, -0x8(%rcx)\n"
-    "movq %rcx, %rsp\n"
-    "subq $0x10, %rsp\n"
-    "movq %rbp, (%rsp)\n"
-    "movq %rsp, %rbp\n"
-    "call coroutine_executor\n");
+struct co_event_loop *co_get_loop() {
+    return tls_loop;
+}
 
-_Noreturn void prepare_stack_switch(void *func_ptr, void *arg, void *env, void *stack_ptr);
+int64_t co_min_wait_time() {
+    struct co_event_loop *loop = tls_loop;
+    int64_t expire;
+    if (loop->timer_kind == CO_TIMER_WHEEL) {
+        expire = wheel_next_expire(&loop->timer_wheel);
+    } else {
+        expire = heap_empty(&loop->timer_heap) ? -1 : loop->timer_heap.nodes[0].key;
+    }
+    if (expire == -1) {
+        return -1;
+    }
+    int64_t now = loop_now(loop);
+    if (expire - now < 0) {
+        return 0;
+    }
+    return expire - now;
+}
 
+int co_loop_epoll_fd(struct co_event_loop *loop) {
+    return loop->epoll_fd;
+}
 
-static enum co_error init_coroutine(struct coroutine *co) {
-    co->jmp_env = NULL;
-    co->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (co->stack == MAP_FAILED) {
-        free(co->jmp_env);
-        return CO_ALLOC_ERR;
+static struct io_uring_sqe *loop_get_sqe(struct co_event_loop *loop, uint32_t count) {
+    // 带超时的请求要和 LINK_TIMEOUT 在同一批提交，空间不够就先把已有的提交掉
+    if (uring_sq_space(&loop->ring) < count) {
+        uring_enter(&loop->ring, 0, NULL);
+        if (uring_sq_space(&loop->ring) < count) {
+            return NULL;
+        }
     }
-    co->stack_size = STACK_SIZE;
-    co->name[0] = '\0';
-    co->status = COROUTINE_STATUS_IDLE;
-    return CO_SUCCESS;
+    return uring_get_sqe(&loop->ring);
 }
 
-static void deinit_coroutine(struct coroutine *co) {
-    munmap(co->stack, STACK_SIZE);
-    co->stack = NULL;
-    co->stack_size = 0;
-    co->status = COROUTINE_STATUS_IDLE;
+static int arm_loop_poll(struct co_event_loop *loop, int *fd) {
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, 1);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = *fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t) fd | URING_TAG_POLL;
+    return 0;
 }
 
-static void co_switch_context(struct co_event_loop *loop, struct co_future *dst_future) {
-    struct coroutine *current_co = loop->current_co;
-    jmp_buf env;
-    current_co->jmp_env = env;
-    if (setjmp(env)) {
-        loop->current_co = current_co;
-        current_co->status = COROUTINE_STATUS_RUNNING;
+// 等 io_uring 的协程挂起期间不会开始别的等待，直接用当前这一代
+static void wake_uring_waiter(struct co_event_loop *loop, struct coroutine *co) {
+    if (claim_wakeup(co, atomic_load_explicit(&co->wait_gen, memory_order_acquire)) != CO_SUCCESS) {
         return;
     }
-    loop->current_co = dst_future->co;
-    if (dst_future->co->jmp_env == NULL) {
-        printf("jmp_env is null, name = %s\n", dst_future->co->name);
-        abort();
+    make_ready(loop, co);
+}
+
+static void complete_accept(struct co_event_loop *loop, struct co_uring_acceptor *acceptor,
+                            struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        acceptor->armed = false;
+    }
+    if (cqe->res >= 0) {
+        if (acceptor->count == acceptor->cap) {
+            uint32_t cap = acceptor->cap == 0 ? 16 : acceptor->cap * 2;
+            int *pending = malloc(cap * sizeof(int));
+            if (pending == NULL) {
+                close(cqe->res);
+                return;
+            }
+            for (uint32_t i = 0; i < acceptor->count; i++) {
+                pending[i] = acceptor->pending[(acceptor->head + i) % acceptor->cap];
+            }
+            free(acceptor->pending);
+            acceptor->pending = pending;
+            acceptor->head = 0;
+            acceptor->cap = cap;
+        }
+        acceptor->pending[(acceptor->head + acceptor->count) % acceptor->cap] = cqe->res;
+        acceptor->count++;
+    } else if (cqe->res == -EINVAL && !acceptor->single_shot) {
+        // 内核不支持 multishot accept，之后每次单独提交
+        acceptor->single_shot = true;
+    } else {
+        acceptor->error = -cqe->res;
+    }
+    if (acceptor->waiter != NULL) {
+        struct coroutine *waiter = acceptor->waiter;
+        acceptor->waiter = NULL;
+        wake_uring_waiter(loop, waiter);
     }
-    longjmp(dst_future->co->jmp_env, 1);
 }
 
-void co_wakeup(struct co_event_loop *loop, struct co_future *future) {
-    if (loop == NULL || future == NULL) {
-        return;
+static void reap_uring(struct co_event_loop *loop) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+        void *ptr = (void *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_TAG_MASK);
+        switch (cqe->user_data & URING_TAG_MASK) {
+            case URING_TAG_OP: {
+                struct coroutine *co = ptr;
+                co->uring_res = cqe->res;
+                wake_uring_waiter(loop, co);
+                break;
+            }
+            case URING_TAG_ACCEPT:
+                complete_accept(loop, ptr, cqe);
+                break;
+            case URING_TAG_POLL:
+                if (ptr == &loop->event_fd) {
+                    uint64_t value;
+                    while (read(loop->event_fd, &value, sizeof(value)) == -1 && errno == EINTR) {
+                    }
+                    drain_inbox(loop);
+                } else {
+                    loop->epoll_pending = true;
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    arm_loop_poll(loop, ptr);
+                }
+                break;
+            default:
+                break;
+        }
+        uring_cqe_seen(&loop->ring);
     }
-    if (future->ready) {
-        printf("future is already ready\n");
-        abort();
+}
+
+// 事件循环自己的 event_fd 和 co_io 的事件在这里处理掉，只把用户注册的事件交给调用者
+static int filter_events(struct co_event_loop *loop, struct epoll_event *events, int num_events) {
+    if (num_events <= 0) {
+        return num_events;
     }
-    future->ready = true;
-    struct coroutine *co = future->co;
-    co->status = COROUTINE_STATUS_READY;
-    push_queue(loop->ready_queue, future);
+    int count = 0;
+    for (int i = 0; i < num_events; i++) {
+        if (events[i].data.ptr == loop) {
+            uint64_t value;
+            while (read(loop->event_fd, &value, sizeof(value)) == -1 && errno == EINTR) {
+            }
+            drain_inbox(loop);
+            continue;
+        }
+        if (events[i].data.u64 & CO_IO_EVENT_TAG) {
+            co_io_on_event(events[i].data.u64, events[i].events);
+            continue;
+        }
+        events[count++] = events[i];
+    }
+    return count;
 }
 
-static void proc_timer_event(struct co_event_loop *loop) {
-    struct timespec now_spec;
-    clock_gettime(CLOCK_MONOTONIC, &now_spec);
-    int64_t now = now_spec.tv_sec * 1000000000 + now_spec.tv_nsec;
-    while (!heap_empty(&g_timer_heap) && g_timer_heap.nodes[0].key <= now) {
-        struct co_future *future = heap_pop(&g_timer_heap).data;
-        co_wakeup(loop, future);
+// 提交这一轮积攒的请求并等待完成事件，epoll_fd 可读时再取 epoll 事件
+static int uring_loop_wait(struct co_event_loop *loop, struct epoll_event *events, int max_events, int64_t wait_ns) {
+    struct __kernel_timespec ts = {
+            .tv_sec = wait_ns / 1000000000,
+            .tv_nsec = wait_ns % 1000000000,
+    };
+    uint32_t wait_nr = wait_ns == 0 || loop->epoll_pending ? 0 : 1;
+    int ret = uring_enter(&loop->ring, wait_nr, wait_ns == -1 ? NULL : &ts);
+    refresh_clock(loop);
+    loop->clock_fresh = true;
+    reap_uring(loop);
+    if (ret < 0 && ret != -ETIME && ret != -EBUSY) {
+        errno = -ret;
+        return -1;
+    }
+    if (!loop->epoll_pending) {
+        return 0;
     }
+    int num_events = epoll_wait(loop->epoll_fd, events, max_events, 0);
+    // 水平触发的 fd 取完不会再唤醒 poll，有事件就下一轮接着查
+    loop->epoll_pending = num_events > 0;
+    return filter_events(loop, events, num_events);
 }
 
-void co_yield() {
-    struct co_event_loop *loop = &g_event_loop;
-    struct coroutine *co = loop->current_co;
-    proc_timer_event(loop);
-    struct co_future *dst_future = pop_queue(loop->ready_queue);
-    if (dst_future == NULL) {
-        printf("%s: no coroutine to run\n", __func__);
-        return;
+int co_loop_wait(struct co_event_loop *loop, struct epoll_event *events, int max_events) {
+    drain_inbox(loop);
+    int64_t wait_ns = 0;
+    if (ready_count(loop) == 0) {
+        wait_ns = co_min_wait_time();
     }
-    co->status = COROUTINE_STATUS_READY;
-    struct co_future current_future = co_new_future();
-    push_queue(loop->ready_queue, &current_future);
-    co_switch_context(loop, dst_future);
+    if (loop->io_kind == CO_IO_URING) {
+        return uring_loop_wait(loop, events, max_events, wait_ns);
+    }
+    int wait_ms;
+    if (wait_ns == -1) {
+        wait_ms = -1;
+    } else {
+        // 向上取整，避免定时器还差不到 1ms 时空转
+        int64_t wms = (wait_ns + 999999) / 1000000;
+        wait_ms = wms > INT_MAX ? INT_MAX : (int) wms;
+    }
+    int num_events = epoll_wait(loop->epoll_fd, events, max_events, wait_ms);
+    refresh_clock(loop);
+    loop->clock_fresh = true;
+    return filter_events(loop, events, num_events);
 }
 
-void co_block() {
-    struct co_event_loop *loop = &g_event_loop;
-    struct coroutine *co = loop->current_co;
-    proc_timer_event(loop);
-    struct co_future *dst_future = pop_queue(loop->ready_queue);
-    if (dst_future == NULL) {
-        printf("%s: no coroutine to run\n", __func__);
-        abort();
+static struct io_uring_sqe *uring_prep(struct co_event_loop *loop, uint8_t opcode, int fd, int64_t deadline) {
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, deadline == -1 ? 1 : 2);
+    if (sqe == NULL) {
+        return NULL;
     }
-    co->status = COROUTINE_STATUS_BLOCKED;
-    co_switch_context(loop, dst_future);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t) loop->current_co | URING_TAG_OP;
+    return sqe;
 }
 
-void co_sleep(int64_t ns) {
-    struct co_future future = co_new_future();
-    struct timespec now_spec;
-    clock_gettime(CLOCK_MONOTONIC, &now_spec);
-    int64_t now = now_spec.tv_sec * 1000000000 + now_spec.tv_nsec;
-    int64_t future_time = now + ns;
-    heap_push(&g_timer_heap, (quad_heap_node) {future_time, &future});
-    struct co_event_loop *loop = &g_event_loop;
+// 请求随下一次 co_loop_wait 一起提交，当前协程挂起直到完成事件到达
+static int32_t uring_wait(struct co_event_loop *loop, struct io_uring_sqe *sqe, int64_t deadline) {
+    struct coroutine *co = loop->current_co;
+    if (deadline != -1) {
+        co->uring_deadline.tv_sec = deadline / 1000000000;
+        co->uring_deadline.tv_nsec = deadline % 1000000000;
+        sqe->flags |= IOSQE_IO_LINK;
+        struct io_uring_sqe *timeout = uring_get_sqe(&loop->ring);
+        timeout->opcode = IORING_OP_LINK_TIMEOUT;
+        timeout->addr = (uintptr_t) &co->uring_deadline;
+        timeout->len = 1;
+        timeout->timeout_flags = IORING_TIMEOUT_ABS;
+        timeout->user_data = URING_TAG_IGNORE;
+    }
+    co_current_future();
     co_block();
+    if (deadline != -1 && co->uring_res == -ECANCELED) {
+        return -ETIMEDOUT;
+    }
+    return co->uring_res;
 }
 
-static struct coroutine *get_idle_coroutine() {
-    struct coroutine *co = pop_queue(&co_idle_queue);
-    if (co != NULL) {
-        return co;
+ssize_t co_uring_read(int fd, void *buf, size_t count, int64_t deadline) {
+    struct co_event_loop *loop = tls_loop;
+    if (loop->io_kind != CO_IO_URING) {
+        return -EOPNOTSUPP;
     }
-    if (queue_full(&co_all_queue)) {
-        g_error = CO_QUEUE_FULL;
-        return NULL;
+    struct io_uring_sqe *sqe = uring_prep(loop, IORING_OP_READ, fd, deadline);
+    if (sqe == NULL) {
+        return -EBUSY;
     }
-    co = malloc(sizeof(struct coroutine));
-    if (co == NULL) {
-        g_error = CO_ALLOC_ERR;
-        return NULL;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = count > UINT32_MAX ? UINT32_MAX : (uint32_t) count;
+    sqe->off = (uint64_t) -1;
+    return uring_wait(loop, sqe, deadline);
+}
+
+ssize_t co_uring_write(int fd, const void *buf, size_t count, int64_t deadline) {
+    struct co_event_loop *loop = tls_loop;
+    if (loop->io_kind != CO_IO_URING) {
+        return -EOPNOTSUPP;
     }
-    enum co_error ret = init_coroutine(co);
-    if (ret != 0) {
-        g_error = ret;
-        free(co);
+    struct io_uring_sqe *sqe = uring_prep(loop, IORING_OP_WRITE, fd, deadline);
+    if (sqe == NULL) {
+        return -EBUSY;
+    }
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = count > UINT32_MAX ? UINT32_MAX : (uint32_t) count;
+    sqe->off = (uint64_t) -1;
+    return uring_wait(loop, sqe, deadline);
+}
+
+int co_uring_close(int fd) {
+    struct co_event_loop *loop = tls_loop;
+    if (loop->io_kind != CO_IO_URING) {
+        return -EOPNOTSUPP;
+    }
+    struct io_uring_sqe *sqe = uring_prep(loop, IORING_OP_CLOSE, fd, -1);
+    if (sqe == NULL) {
+        return close(fd) == 0 ? 0 : -errno;
+    }
+    return uring_wait(loop, sqe, -1);
+}
+
+void co_uring_acceptor_init(struct co_uring_acceptor *acceptor, int listen_fd) {
+    memset(acceptor, 0, sizeof(*acceptor));
+    acceptor->fd = listen_fd;
+}
+
+void co_uring_acceptor_deinit(struct co_uring_acceptor *acceptor) {
+    for (uint32_t i = 0; i < acceptor->count; i++) {
+        close(acceptor->pending[(acceptor->head + i) % acceptor->cap]);
+    }
+    free(acceptor->pending);
+    acceptor->pending = NULL;
+    acceptor->count = 0;
+    acceptor->cap = 0;
+}
+
+int co_uring_accept(struct co_uring_acceptor *acceptor) {
+    struct co_event_loop *loop = tls_loop;
+    if (loop->io_kind != CO_IO_URING) {
+        return -EOPNOTSUPP;
+    }
+    while (true) {
+        if (acceptor->count > 0) {
+            int fd = acceptor->pending[acceptor->head];
+            acceptor->head = (acceptor->head + 1) % acceptor->cap;
+            acceptor->count--;
+            return fd;
+        }
+        if (acceptor->error != 0) {
+            int error = acceptor->error;
+            acceptor->error = 0;
+            return -error;
+        }
+        if (!acceptor->armed) {
+            struct io_uring_sqe *sqe = loop_get_sqe(loop, 1);
+            if (sqe == NULL) {
+                return -EBUSY;
+            }
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = acceptor->fd;
+            sqe->ioprio = acceptor->single_shot ? 0 : IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = (uintptr_t) acceptor | URING_TAG_ACCEPT;
+            acceptor->armed = true;
+        }
+        acceptor->waiter = loop->current_co;
+        co_current_future();
+        co_block();
+    }
+}
+
+void co_uring_acceptor_cancel(struct co_uring_acceptor *acceptor) {
+    struct co_event_loop *loop = tls_loop;
+    if (!acceptor->armed) {
+        return;
+    }
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, 1);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) acceptor | URING_TAG_ACCEPT;
+    sqe->user_data = URING_TAG_IGNORE;
+    // 最后一个完成事件不带 IORING_CQE_F_MORE，之后内核不会再引用 acceptor
+    while (acceptor->armed) {
+        acceptor->waiter = loop->current_co;
+        co_current_future();
+        co_block();
+    }
+    acceptor->error = 0;
+}
+
+void *co_buffer_alloc() {
+    struct co_event_loop *loop = tls_loop;
+    if (loop->max_buffers != 0 && loop->buffer_pool.in_use >= loop->max_buffers) {
         return NULL;
     }
-    push_queue(&co_all_queue, co);
-    return co;
+    return slab_alloc(&loop->buffer_pool);
 }
 
-enum co_error co_spawn(struct co_event_loop *loop, coroutine_func func, void *arg, char *name) {
-    struct coroutine *co = get_idle_coroutine();
-    if (co == NULL) {
-        enum co_error ret = g_error;
-        g_error = CO_SUCCESS;
-        return ret;
+static void wake_buffer_waiter(struct co_event_loop *loop) {
+    struct co_wait_node *node = loop->buffer_waiters;
+    if (node == NULL) {
+        return;
     }
-    enum co_error ret = init_coroutine(co);
-    if (ret != 0) {
-        free(co);
-        return ret;
+    loop->buffer_waiters = node->next;
+    if (loop->buffer_waiters == NULL) {
+        loop->buffer_waiters_tail = NULL;
     }
-    strncpy(co->name, name, NAME_LEN);
-    jmp_buf env;
-    struct coroutine *cur_co = loop->current_co;
-    if (setjmp(env) == 0) {
-        loop->current_co = co;
-        prepare_stack_switch(func, arg, env, co->stack + co->stack_size);
+    node->next = NULL;
+    node->queued = false;
+    co_wakeup(loop, node->future);
+}
+
+static void remove_buffer_waiter(struct co_event_loop *loop, struct co_wait_node *node) {
+    struct co_wait_node *prev = NULL;
+    for (struct co_wait_node *p = loop->buffer_waiters; p != node; p = p->next) {
+        prev = p;
     }
-    loop->current_co = cur_co;
-    return CO_SUCCESS;
+    if (prev == NULL) {
+        loop->buffer_waiters = node->next;
+    } else {
+        prev->next = node->next;
+    }
+    if (loop->buffer_waiters_tail == node) {
+        loop->buffer_waiters_tail = prev;
+    }
+    node->next = NULL;
+    node->queued = false;
 }
 
-int co_dispatch(struct co_event_loop *loop) {
-    proc_timer_event(loop);
-    while (queue_size(loop->ready_queue) > 0) {
-        co_yield();
+void *co_buffer_alloc_wait(int64_t deadline) {
+    struct co_event_loop *loop = tls_loop;
+    // 前面有人排队时不插队
+    void *buf = loop->buffer_waiters == NULL ? co_buffer_alloc() : NULL;
+    while (buf == NULL) {
+        struct co_wait_node *node = co_current_wait_node();
+        node->queued = true;
+        if (loop->buffer_waiters_tail == NULL) {
+            loop->buffer_waiters = node;
+        } else {
+            loop->buffer_waiters_tail->next = node;
+        }
+        loop->buffer_waiters_tail = node;
+        int ret = co_block_until(deadline);
+        if (node->queued) {
+            remove_buffer_waiter(loop, node);
+        } else if (ret != 0) {
+            // 超时和归还撞在一起，这块缓冲区转给下一个
+            wake_buffer_waiter(loop);
+        }
+        if (ret != 0) {
+            errno = ret;
+            return NULL;
+        }
+        // 被叫醒后缓冲区也可能已经被不排队的 co_buffer_alloc 拿走，重新排到队尾
+        buf = co_buffer_alloc();
+    }
+    return buf;
+}
+
+void co_buffer_free(void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    slab_free(&tls_loop->buffer_pool, buf);
+    wake_buffer_waiter(tls_loop);
+    check_load_waiter(tls_loop);
+}
+
+void co_loop_load(struct co_event_loop *loop, struct co_load *load) {
+    load->coroutines = atomic_load(&loop->live_count);
+    load->max_coroutines = loop->max_size;
+    load->buffers = (int) loop->buffer_pool.in_use;
+    load->max_buffers = (int) loop->max_buffers;
+}
+
+int co_wait_load_below(int percent, int64_t deadline) {
+    struct co_event_loop *loop = tls_loop;
+    if (load_below(loop, percent)) {
+        return 0;
+    }
+    if (loop->load_waiter.co != NULL) {
+        return EBUSY;
+    }
+    loop->load_percent = percent;
+    loop->load_waiter = co_current_future();
+    int ret = co_block_until(deadline);
+    loop->load_waiter.co = NULL;
+    return ret;
+}
+
+struct co_slab *co_slab_new(size_t object_size, uint32_t objects_per_region) {
+    struct co_slab *slab = malloc(sizeof(struct co_slab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    if (init_slab(&slab->slab, object_size, objects_per_region) != 0) {
+        free(slab);
+        return NULL;
+    }
+    slab->next = tls_loop->slabs;
+    tls_loop->slabs = slab;
+    return slab;
+}
+
+void *co_slab_alloc(struct co_slab *slab) {
+    return slab_alloc(&slab->slab);
+}
+
+void co_slab_free(struct co_slab *slab, void *object) {
+    slab_free(&slab->slab, object);
+}
+
+enum co_io_kind co_loop_io_kind(struct co_event_loop *loop) {
+    return loop->io_kind;
+}
+
+static int init_loop_uring(struct co_event_loop *loop, const struct co_config *config) {
+    loop->io_kind = config->io;
+    loop->ring.fd = -1;
+    if (loop->io_kind != CO_IO_URING) {
+        return 0;
+    }
+    uint32_t entries = config->uring_entries > 0 ? config->uring_entries : DEFAULT_URING_ENTRIES;
+    if (init_uring(&loop->ring, entries) != 0) {
+        return -1;
+    }
+    if (arm_loop_poll(loop, &loop->event_fd) != 0 || arm_loop_poll(loop, &loop->epoll_fd) != 0) {
+        deinit_uring(&loop->ring);
+        return -1;
     }
     return 0;
 }
 
-struct co_event_loop *co_get_loop() {
-    return &g_event_loop;
+static int init_loop_fd(struct co_event_loop *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        return -1;
+    }
+    loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->event_fd == -1) {
+        close(loop->epoll_fd);
+        return -1;
+    }
+    struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = loop,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &event) == -1) {
+        close(loop->event_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+    return 0;
 }
 
-int64_t co_min_wait_time() {
-    if (heap_empty(&g_timer_heap)) {
+// 给本线程装上看门狗信号用的备用栈，失败返回 -1。线程已经有备用栈时沿用，*stack 为 NULL
+static int init_signal_stack(void **stack_out) {
+    *stack_out = NULL;
+    stack_t old;
+    if (sigaltstack(NULL, &old) != 0) {
         return -1;
     }
-    struct timespec now_spec;
-    clock_gettime(CLOCK_MONOTONIC, &now_spec);
-    int64_t now = now_spec.tv_sec * 1000000000 + now_spec.tv_nsec;
-    if (g_timer_heap.nodes[0].key - now < 0) {
+    if (!(old.ss_flags & SS_DISABLE)) {
         return 0;
     }
-    return g_timer_heap.nodes[0].key - now;
+#ifdef _SC_MINSIGSTKSZ
+    long min_size = sysconf(_SC_MINSIGSTKSZ);
+#else
+    long min_size = MINSIGSTKSZ;
+#endif
+    if (min_size < MINSIGSTKSZ) {
+        min_size = MINSIGSTKSZ;
+    }
+    size_t size = (size_t) min_size + SIGSTKSZ;
+    void *stack = malloc(size);
+    if (stack == NULL) {
+        return -1;
+    }
+    stack_t ss = {
+            .ss_sp = stack,
+            .ss_size = size,
+            .ss_flags = 0,
+    };
+    if (sigaltstack(&ss, NULL) != 0) {
+        free(stack);
+        return -1;
+    }
+    *stack_out = stack;
+    return 0;
+}
+
+static void deinit_signal_stack(void *stack) {
+    if (stack == NULL) {
+        return;
+    }
+    stack_t ss = {
+            .ss_flags = SS_DISABLE,
+    };
+    sigaltstack(&ss, NULL);
+    free(stack);
 }
 
 int co_setup(int max_size) {
-    if (max_size <= 0) {
+    struct co_config config = {
+            .max_size = max_size,
+            .timer = CO_TIMER_WHEEL,
+    };
+    return co_setup_with(&config);
+}
+
+int co_setup_with(const struct co_config *config) {
+    int max_size = config->max_size;
+    if (max_size <= 0 || config->timer_tick_ns < 0 || config->dispatch_budget_ns < 0) {
+        return -1;
+    }
+    if (tls_loop != NULL) {
         return -1;
     }
-    if (g_event_loop.ready_queue != NULL) {
+    // loop 是清零分配的，各个 deinit 对还没初始化的部分什么也不做，失败时按初始化的逆序整体回退
+    struct co_event_loop *loop = calloc(1, sizeof(struct co_event_loop));
+    if (loop == NULL) {
         return -1;
     }
-    if (init_queue(&co_idle_queue, max_size) != 0) {
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        if (init_queue(&loop->idle_queue[i], max_size) != 0) {
+            goto end6;
+        }
+    }
+    if (init_queue(&loop->all_queue, max_size) != 0) {
+        goto end6;
+    }
+    loop->clock_kind = config->clock;
+    refresh_clock(loop);
+    loop->timer_kind = config->timer;
+    if (loop->timer_kind == CO_TIMER_WHEEL) {
+        int64_t tick_ns = config->timer_tick_ns > 0 ? config->timer_tick_ns : DEFAULT_TIMER_TICK_NS;
+        init_wheel(&loop->timer_wheel, tick_ns, loop->now);
+    } else if (init_heap(&loop->timer_heap, max_size) != 0) {
+        goto end5;
+    }
+    // 每种栈大小一次预留 max_size 个栈的地址空间，避免之后再 mmap 时触到 vm.max_map_count
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        if (stack_class_size[i] == 0) {
+            continue;
+        }
+        if (init_stack_pool(&loop->stack_pool[i], stack_class_size[i], max_size) != 0) {
+            goto end5;
+        }
+    }
+    if (init_deque(&loop->deque, max_size) != 0) {
+        goto end5;
+    }
+    if (init_loop_fd(loop) != 0) {
+        goto end4;
+    }
+    if (init_loop_uring(loop, config) != 0) {
         goto end3;
     }
-    if (init_queue(&co_all_queue, max_size) != 0) {
+    if (init_slab(&loop->co_slab, sizeof(struct coroutine), COROUTINE_SLAB_REGION) != 0 ||
+        init_slab(&loop->buffer_pool, CO_BUFFER_SIZE, BUFFER_SLAB_REGION) != 0) {
         goto end2;
     }
-    if (init_heap(&g_timer_heap, max_size) != 0) {
-        goto end1;
+    loop->slabs = NULL;
+    // 主协程不算在内
+    loop->max_size = max_size - 1;
+    loop->max_buffers = config->max_buffers;
+    loop->wakeup_order = config->wakeup;
+    for (int i = 0; i < CO_PRIO_COUNT; i++) {
+        loop->weight[i] = config->priority_weight[i] > 0 ? config->priority_weight[i] : default_priority_weight[i];
     }
-    g_event_loop.ready_queue = malloc(sizeof(struct array_queue));
-    if (g_event_loop.ready_queue == NULL) {
+    memcpy(loop->credit, loop->weight, sizeof(loop->credit));
+    loop->dispatch_budget_ns = config->dispatch_budget_ns;
+    struct coroutine *co = slab_alloc(&loop->co_slab);
+    if (co == NULL) {
         goto end1;
     }
-    if (init_queue(g_event_loop.ready_queue, max_size) != 0) {
-        goto end0;
+    memset(co, 0, sizeof(struct coroutine));
+    strncpy(co->name, "main", NAME_LEN);
+    co->status = COROUTINE_STATUS_RUNNING;
+    co->owner = loop;
+    co->loop = loop;
+    push_queue(&loop->all_queue, co);
+    loop->main_co = co;
+    loop->current_co = co;
+    if (pthread_mutex_init(&loop->remote_idle_lock, NULL) != 0) {
+        goto end1;
     }
-    struct coroutine *co = calloc(sizeof(struct coroutine), 1);
-    if (co == NULL) {
+    if (init_signal_stack(&loop->signal_stack) != 0) {
         goto end0;
     }
-    strncpy(co->name, "main", NAME_LEN);
-    co->status = COROUTINE_STATUS_RUNNING;
-    push_queue(&co_all_queue, co);
-    g_event_loop.current_co = co;
+    loop->thread = pthread_self();
+    tls_loop = loop;
+    register_loop(loop);
     return 0;
     end0:
-    deinit_queue(g_event_loop.ready_queue);
+    pthread_mutex_destroy(&loop->remote_idle_lock);
     end1:
-    deinit_queue(&co_idle_queue);
+    deinit_slab(&loop->co_slab);
+    deinit_slab(&loop->buffer_pool);
     end2:
-    deinit_queue(&co_all_queue);
+    deinit_uring(&loop->ring);
     end3:
+    close(loop->event_fd);
+    close(loop->epoll_fd);
+    end4:
+    deinit_deque(&loop->deque);
+    end5:
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        deinit_stack_pool(&loop->stack_pool[i]);
+    }
+    deinit_heap(&loop->timer_heap);
+    end6:
+    deinit_queue(&loop->all_queue);
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        deinit_queue(&loop->idle_queue[i]);
+    }
+    free(loop);
     return -1;
 }
 
 int co_teardown() {
-    while (queue_size(&co_all_queue) > 0) {
-        struct coroutine *co = pop_queue(&co_all_queue);
+    struct co_event_loop *loop = tls_loop;
+    if (loop == NULL) {
+        return -1;
+    }
+    unregister_loop(loop);
+    // 看门狗已经发出的信号可能在这之后才到，处理函数看到 NULL 就不再碰 loop
+    tls_loop = NULL;
+    atomic_signal_fence(memory_order_seq_cst);
+    while (queue_size(&loop->all_queue) > 0) {
+        struct coroutine *co = pop_queue(&loop->all_queue);
         deinit_coroutine(co);
-        free(co);
-    }
-    deinit_queue(&co_idle_queue);
-    deinit_queue(&co_all_queue);
-    deinit_heap(&g_timer_heap);
-    deinit_queue(g_event_loop.ready_queue);
-    free(g_event_loop.ready_queue);
-    g_event_loop.ready_queue = NULL;
+    }
+    deinit_slab(&loop->co_slab);
+    deinit_slab(&loop->buffer_pool);
+    while (loop->slabs != NULL) {
+        struct co_slab *slab = loop->slabs;
+        loop->slabs = slab->next;
+        deinit_slab(&slab->slab);
+        free(slab);
+    }
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        deinit_queue(&loop->idle_queue[i]);
+        deinit_stack_pool(&loop->stack_pool[i]);
+    }
+    deinit_queue(&loop->all_queue);
+    deinit_heap(&loop->timer_heap);
+    deinit_deque(&loop->deque);
+    pthread_mutex_destroy(&loop->remote_idle_lock);
+    deinit_uring(&loop->ring);
+    close(loop->event_fd);
+    close(loop->epoll_fd);
+    deinit_signal_stack(loop->signal_stack);
+    free(loop);
     return 0;
 }
 
@@ -318,14 +2088,46 @@ static const char *get_status_str(enum coroutine_status status) {
 }
 
 void co_print_all_coroutine() {
-    printf("Ready future:     %d\n", queue_size(g_event_loop.ready_queue));
-    printf("Idle coroutine:   %d\n", queue_size(&co_idle_queue));
-    printf("All coroutine:    %d\n", queue_size(&co_all_queue));
-    for (int i = 0; i < queue_size(&co_all_queue); i++) {
-        struct coroutine *co = co_all_queue.coroutines[queue_cvt_pos(&co_all_queue, i)];
+    struct co_event_loop *loop = tls_loop;
+    printf("Ready future:     %d\n", ready_count(loop));
+    uint32_t idle_count = 0;
+    uint32_t unguarded_count = 0;
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        idle_count += queue_size(&loop->idle_queue[i]);
+        unguarded_count += loop->stack_pool[i].unguarded;
+    }
+    printf("Idle coroutine:   %d\n", idle_count);
+    printf("All coroutine:    %d\n", queue_size(&loop->all_queue));
+    printf("Stolen coroutine: %ld\n", loop->steal_count);
+    printf("Borrowed buffer:  %d\n", loop->buffer_pool.in_use);
+    if (unguarded_count > 0) {
+        printf("Unguarded stack:  %d\n", unguarded_count);
+    }
+#ifdef CO_STACK_DEBUG
+    for (int i = 0; i < CO_STACK_CLASS_COUNT; i++) {
+        if (stack_class_size[i] == 0) {
+            continue;
+        }
+        printf("Stack %4zuK max:  %zu\n", stack_class_size[i] / 1024, loop->stack_class_high_water[i]);
+    }
+#endif
+    for (uint32_t i = 0; i < queue_size(&loop->all_queue); i++) {
+        struct coroutine *co = loop->all_queue.coroutines[queue_cvt_pos(&loop->all_queue, i)];
         if (co->status == COROUTINE_STATUS_IDLE) {
             continue;
         }
+        if (co->stack_class == CO_STACK_SHARED) {
+            printf("    coroutine %s: %s, saved %zu\n", co->name, get_status_str(co->status), co->save_cap);
+            continue;
+        }
+#ifdef CO_STACK_DEBUG
+        if (co->stack != NULL) {
+            record_high_water(co);
+            printf("    coroutine %s: %s, stack %zu/%zd\n", co->name, get_status_str(co->status),
+                   co->high_water, co->stack_size);
+            continue;
+        }
+#endif
         printf("    coroutine %s: %s\n", co->name, get_status_str(co->status));
     }
     printf("===END===\n");
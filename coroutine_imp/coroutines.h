@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/epoll.h>
 
 enum coroutine_status {
     COROUTINE_STATUS_IDLE,
@@ -18,45 +19,323 @@ enum coroutine_status {
     COROUTINE_STATUS_SLEEPING,
 };
 
+// 等待句柄，按值传递。协程每次用 co_current_future() 开始等待时发出新的一代，
+// 唤醒时核对代数，过期或者重复的唤醒只返回错误，不会把协程重复放进就绪队列
 struct co_future {
     struct coroutine *co;
-    bool ready;
-};
-struct co_event_loop {
-    void *ready_queue;
-    void *current_co;
-    int64_t sleep_count;
+    uint32_t gen;
 };
+// 每个线程调用 co_setup 后拥有自己的 co_event_loop，只能在该线程上使用
+struct co_event_loop;
+
+struct co_slab;
+
 enum co_error {
     CO_SUCCESS = 0,
     CO_ALLOC_ERR = 1,
     CO_QUEUE_FULL = 2,
     CO_QUEUE_EMPTY = 3,
     CO_HEAP_EMPTY = 4,
+    CO_INVALID_ARG = 5,
+    CO_ALREADY_READY = 6,
+    // 协程已经不在等这一代了，例如超时返回之后
+    CO_STALE_FUTURE = 7,
+};
+
+enum co_stack_class {
+    CO_STACK_8K,
+    CO_STACK_32K,
+    CO_STACK_128K,
+    CO_STACK_1M,
+    // 在共享栈上运行，挂起时只把用到的部分拷贝到堆上
+    CO_STACK_SHARED,
+    CO_STACK_CLASS_COUNT,
+};
+
+#define CO_BUFFER_SIZE (16 * 1024)
+
+// 每个优先级一个就绪队列，co_dispatch 按 co_config.priority_weight 加权轮转，低优先级不会饿死
+enum co_priority {
+    CO_PRIO_NORMAL,
+    // 延迟敏感的协程，例如处理请求的连接
+    CO_PRIO_LATENCY,
+    // 后台任务，被其他协程唤醒时也不插队
+    CO_PRIO_BACKGROUND,
+    CO_PRIO_COUNT,
+};
+
+struct co_spawn_attr {
+    enum co_stack_class stack_class;
+    // 允许空闲的事件循环把它偷到别的线程上运行，协程里不能缓存线程局部的状态。
+    // 只有 CO_PRIO_NORMAL 的协程会被偷
+    bool migratable;
+    enum co_priority priority;
+};
+
+enum co_timer_kind {
+    // 分层时间轮，插入删除 O(1)，精度为一个 tick
+    CO_TIMER_WHEEL,
+    // 四叉堆，插入删除 O(log n)，精确到纳秒
+    CO_TIMER_HEAP,
+};
+
+enum co_clock_kind {
+    // 每次 co_loop_wait 返回时读一次时钟，期间每切换 64 次协程再补读一次
+    CO_CLOCK_CACHED,
+    // 每次切换都读 CLOCK_MONOTONIC_COARSE，开销很小但精度只有几毫秒
+    CO_CLOCK_COARSE,
+    // 每次用到都读 CLOCK_MONOTONIC
+    CO_CLOCK_PRECISE,
+};
+
+enum co_io_kind {
+    // 就绪通知：epoll_wait 之后自己 read/write，EAGAIN 时挂起
+    CO_IO_EPOLL,
+    // 完成通知：co_uring_* 提交请求后挂起，每轮 co_loop_wait 批量提交一次
+    CO_IO_URING,
+};
+
+enum co_wakeup_order {
+    // 协程里 co_wakeup 的目标放进 run_next 槽，当前协程让出后先运行它，数据还在缓存里。
+    // 槽里原来的协程排到就绪队列末尾，连续从槽里取一定次数后会先照顾就绪队列
+    CO_WAKEUP_LIFO,
+    // 一律排到就绪队列末尾
+    CO_WAKEUP_FIFO,
+};
+
+struct co_config {
+    int max_size;
+    enum co_timer_kind timer;
+    // 时间轮每格的长度，0 表示默认的 1ms
+    int64_t timer_tick_ns;
+    enum co_clock_kind clock;
+    enum co_io_kind io;
+    // io_uring 提交队列的长度，0 表示默认的 256
+    uint32_t uring_entries;
+    // 最多同时借出的 I/O 缓冲区个数，0 表示不限
+    uint32_t max_buffers;
+    enum co_wakeup_order wakeup;
+    // 加权轮转时各优先级每轮最多运行的协程数，0 表示默认值：延迟 8，普通 4，后台 1
+    uint32_t priority_weight[CO_PRIO_COUNT];
+    // co_dispatch 运行超过这么久就返回，让调用者先去取新的 I/O 事件，0 表示不限
+    int64_t dispatch_budget_ns;
+};
+
+// 事件循环的负载，用于接入控制
+struct co_load {
+    // 已经 spawn 还没退出的协程，上限是 max_size 去掉主协程
+    int coroutines;
+    int max_coroutines;
+    int buffers;
+    // 0 表示不限
+    int max_buffers;
+};
+
+// io_uring 的 multishot accept：提交一次持续产生新连接，取空了 co_uring_accept 才挂起
+struct co_uring_acceptor {
+    int fd;
+    int *pending;
+    uint32_t head;
+    uint32_t count;
+    uint32_t cap;
+    int error;
+    bool armed;
+    bool single_shot;
+    struct coroutine *waiter;
 };
 
 typedef void (*coroutine_func)(void *);
 
-void co_wakeup(struct co_event_loop *loop, struct co_future *future);
+// 同一代已经被唤醒过返回 CO_ALREADY_READY，过期的句柄返回 CO_STALE_FUTURE
+enum co_error co_wakeup(struct co_event_loop *loop, struct co_future future);
+
+// 可以在任意线程调用，协程会在它所在的事件循环上恢复。
+// future 交给其他线程之后协程应立即 co_block
+enum co_error co_wakeup_remote(struct co_future future);
+
+// 协程还在等这一代，没有被唤醒
+bool co_future_pending(struct co_future future);
+
+// 线程安全，打断该事件循环正在进行的 co_loop_wait
+void co_loop_notify(struct co_event_loop *loop);
+
+// 事件循环自己的 epoll 实例，fd 注册到这里。event.data.ptr 不能等于 loop，
+// data.u64 最低位为 1 的事件留给 co_io，用户注册时要保证最低位为 0
+int co_loop_epoll_fd(struct co_event_loop *loop);
+
+enum co_io_kind co_loop_io_kind(struct co_event_loop *loop);
+
+// 按最近的定时器决定超时时间等待 epoll 事件，顺带处理其他线程的唤醒，返回剩下的事件个数
+int co_loop_wait(struct co_event_loop *loop, struct epoll_event *events, int max_events);
 
 void co_block();
 
 void co_yield();
 
-void co_sleep(int64_t ns);
+// 阻塞在 co_current_future() 上，直到被唤醒或者到达 deadline（co_now() 的时间，-1 表示不限时）。
+// 被唤醒返回 0，超时返回 ETIMEDOUT，定时器分配内存失败返回 ENOMEM，返回前定时器已经取消。这是取消点：协程被 co_cancel 之后返回 ECANCELED，
+// 这时这一代可能同时也被唤醒了，调用者要像超时一样核对自己的等待状态
+int co_block_until(int64_t deadline);
+
+// 从调用时直接读到的 CLOCK_MONOTONIC 算起至少睡 ns 纳秒，不受 co_config.clock 缓存的影响。
+// 睡满返回 0；其他协程对 co_current_future() 调用 co_wakeup 可以提前叫醒，此时返回 EINTR，被取消返回 ECANCELED，定时器分配内存失败返回 ENOMEM
+int co_sleep(int64_t ns);
+
+// 事件循环缓存的 CLOCK_MONOTONIC，纳秒，精度由 co_config.clock 决定。定时器都按这个时间计算
+int64_t co_now();
 
+// 直接读 CLOCK_MONOTONIC，顺便刷新缓存
+int64_t co_now_precise();
+
+// 运行就绪的协程直到没有为止，或者用完 co_config.dispatch_budget_ns，或者有协程被看门狗要求让出。
+// 没运行完的协程留在队列里，下一次 co_loop_wait 不会阻塞
 int co_dispatch(struct co_event_loop *loop);
 
 enum co_error co_spawn(struct co_event_loop *loop, coroutine_func func, void *arg, char *name);
 
-struct co_future co_new_future();
+enum co_error co_spawn_stack(struct co_event_loop *loop, coroutine_func func, void *arg, char *name,
+                             enum co_stack_class stack_class);
+
+enum co_error co_spawn_with(struct co_event_loop *loop, coroutine_func func, void *arg, char *name,
+                            const struct co_spawn_attr *attr);
+
+typedef void *(*co_task_func)(void *arg);
+
+// spawn 出来的协程的句柄，按值传递。co_join 或 co_detach 之后失效
+struct co_handle {
+    struct coroutine *co;
+    uint32_t id;
+};
+
+// 和 co_spawn_with 一样，另外返回句柄。协程退出后保留到 co_join 或 co_detach 为止，每个句柄必须二选一
+enum co_error co_spawn_task(struct co_event_loop *loop, co_task_func func, void *arg, char *name,
+                            const struct co_spawn_attr *attr, struct co_handle *handle);
+
+// 等协程退出，取回返回值并回收协程，result 可以为 NULL。同一时间只能有一个协程等同一个句柄。
+// 成功返回 0，超时返回 ETIMEDOUT，当前协程被取消返回 ECANCELED，这两种情况之后还可以再 join；句柄无效返回 EINVAL
+int co_join(struct co_handle handle, void **result, int64_t deadline);
+
+// 不再关心返回值，协程退出时自己回收
+void co_detach(struct co_handle handle);
+
+// 请求取消，可以在任意线程调用。取消是协作式的：目标协程正在 co_block_until 里等待会被叫醒，
+// 之后每次调用都立即返回 ECANCELED，建立在它上面的 co_sleep、I/O、同步原语和 channel 也一样。
+// co_block 和 io_uring 请求不会被打断，协程退出之后取消没有效果
+enum co_error co_cancel(struct co_handle handle);
+
+// 当前协程是否已经被取消
+bool co_cancelled();
+
+// 给 co_select 用：协程已经退出返回 1，否则登记 future，退出时叫醒它，返回 0；
+// 句柄无效或者已经有人在等返回 -1
+int co_join_arm(struct co_handle handle, struct co_future future);
+
+// 撤销 co_join_arm，返回协程是否已经退出
+bool co_join_disarm(struct co_handle handle);
+
+// 调度是协作式的，看门狗用来找出长时间不让出的协程。监视线程全局只有一个，检查所有事件循环
+struct co_watchdog_config {
+    // 协程连续运行超过这么久算超时，每次连续运行只报告一次
+    int64_t slice_ns;
+    // 超时时发给事件循环所在线程的信号，0 表示 SIGURG。处理函数在 co_setup 装好的备用信号栈上往 stderr 打印协程名
+    int signal;
+    // 同时打印超时协程的调用栈。可执行文件用 -rdynamic 链接才有函数名。
+    // 信号处理函数里调用 backtrace 不是异步信号安全的，被打断的线程正在 dlopen 或者展开栈时可能死锁，只在排查问题时打开
+    bool backtrace;
+    // 要求超时的协程在下一个 co_maybe_yield 或者 co_io 调用处让出一次
+    bool preempt;
+};
+
+// 成功返回 0，已经在运行返回 EBUSY
+int co_watchdog_start(const struct co_watchdog_config *config);
+
+void co_watchdog_stop();
+
+// 看门狗要求让出时让出一次并返回 true，否则只读一个标志。长时间计算的循环里应该定期调用
+bool co_maybe_yield();
+
+// 这个事件循环上被看门狗发现超时的次数
+int64_t co_overrun_count(struct co_event_loop *loop);
+
+// 修改当前协程的优先级，下次进就绪队列时生效
+enum co_error co_set_priority(enum co_priority priority);
+
+// 当前协程不再参与迁移，例如已经在本线程的 epoll 上注册了 fd
+void co_pin();
+
+int64_t co_steal_count(struct co_event_loop *loop);
+
+// 当前协程开始新的一次等待，之前发出的句柄全部过期。唤醒状态保存在协程里，
+// 句柄可以随意拷贝，CO_STACK_SHARED 协程挂起时也有效。随后用 co_block 或 co_block_until 挂起
+struct co_future co_current_future();
+
+// 同步原语的等待队列节点，嵌在协程里，等待时不用分配内存，也不在协程栈上
+struct co_wait_node {
+    struct co_wait_node *next;
+    struct co_future future;
+    // 还在等待队列里，超时返回前要自己摘掉
+    bool queued;
+};
+
+// 用 co_current_future() 开始新的一次等待，返回当前协程的节点。协程同一时间只能等一个原语
+struct co_wait_node *co_current_wait_node();
+
+// 当前协程在 CO_STACK_SHARED 的共享栈上运行。挂起期间栈上的地址会失效，不能交给别的协程读写
+bool co_current_on_shared_stack();
 
 struct co_event_loop *co_get_loop();
 
 int64_t co_min_wait_time();
 
+// 事件循环的 I/O 缓冲区池，每块 CO_BUFFER_SIZE 字节。连接只在有数据要处理时借用，
+// 空闲等待前归还，空闲连接不占缓冲区。超过 max_buffers 时返回 NULL。只能在所属线程调用，借用的协程不能迁移
+void *co_buffer_alloc();
+
+// 缓冲区用完时排队等别的协程归还，而不是返回 NULL。超时或被取消时返回 NULL，errno 为 ETIMEDOUT 或 ECANCELED。
+// 已经借着缓冲区再等另一块可能互相卡住，这种情况应该用 co_buffer_alloc
+void *co_buffer_alloc_wait(int64_t deadline);
+
+void co_buffer_free(void *buf);
+
+void co_loop_load(struct co_event_loop *loop, struct co_load *load);
+
+// 阻塞到本事件循环的协程数和借出的缓冲区数都不超过上限的 percent%，已经满足时直接返回 0。
+// 同一时间只能有一个协程等待，否则返回 EBUSY；超时返回 ETIMEDOUT。
+// 在其他线程退出的可迁移协程不会叫醒等待者，需要设 deadline 定期复查
+int co_wait_load_below(int percent, int64_t deadline);
+
+// 事件循环自带的定长对象分配器，例如连接状态。只能在所属线程使用，co_teardown 时整体释放
+struct co_slab *co_slab_new(size_t object_size, uint32_t objects_per_region);
+
+void *co_slab_alloc(struct co_slab *slab);
+
+void co_slab_free(struct co_slab *slab, void *object);
+
+// 使用时间轮和默认配置
 int co_setup(int max_size);
 
+int co_setup_with(const struct co_config *config);
+
+// 以下只能在 CO_IO_URING 的事件循环上、在协程里调用，否则返回 -EOPNOTSUPP。
+// 返回值同对应的系统调用，失败返回 -errno。deadline 为 co_now() 的时间，-1 表示不限时，超时返回 -ETIMEDOUT。
+// 内核会在协程挂起期间直接读写 buf，buf 不能放在 CO_STACK_SHARED 协程的栈上
+ssize_t co_uring_read(int fd, void *buf, size_t count, int64_t deadline);
+
+ssize_t co_uring_write(int fd, const void *buf, size_t count, int64_t deadline);
+
+int co_uring_close(int fd);
+
+void co_uring_acceptor_init(struct co_uring_acceptor *acceptor, int listen_fd);
+
+// multishot 请求还在内核里时不能释放，只能在 co_teardown 或者 co_uring_acceptor_cancel 之后调用
+void co_uring_acceptor_deinit(struct co_uring_acceptor *acceptor);
+
+// 在协程里取消还在内核里的 accept 请求，返回时内核已经不再引用 acceptor
+void co_uring_acceptor_cancel(struct co_uring_acceptor *acceptor);
+
+// 返回新连接的 fd（非阻塞），失败返回 -errno
+int co_uring_accept(struct co_uring_acceptor *acceptor);
+
 int co_teardown();
 
 void co_print_all_coroutine();
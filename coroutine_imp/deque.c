@@ -0,0 +1,62 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdlib.h>
+#include "deque.h"
+
+int init_deque(struct work_deque *deque, uint32_t cap) {
+    uint64_t size = 1;
+    while (size < cap) {
+        size <<= 1;
+    }
+    deque->items = calloc(size, sizeof(deque->items[0]));
+    if (deque->items == NULL) {
+        return -1;
+    }
+    deque->mask = size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+void deinit_deque(struct work_deque *deque) {
+    free(deque->items);
+    deque->items = NULL;
+    deque->mask = 0;
+    atomic_store(&deque->top, 0);
+    atomic_store(&deque->bottom, 0);
+}
+
+bool deque_push(struct work_deque *deque, void *item) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if ((uint64_t) (b - t) > deque->mask) {
+        return false;
+    }
+    atomic_store_explicit(&deque->items[b & deque->mask], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+void *deque_steal(struct work_deque *deque) {
+    while (true) {
+        int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+        if (t >= b) {
+            return NULL;
+        }
+        void *item = atomic_load_explicit(&deque->items[t & deque->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed)) {
+            return item;
+        }
+    }
+}
+
+uint32_t deque_size(struct work_deque *deque) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    return b > t ? (uint32_t) (b - t) : 0;
+}
@@ -0,0 +1,33 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_DEQUE_H
+#define EPOLL_COROUTINE_DEQUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Chase-Lev 风格的有界工作窃取队列：只有所属线程 push，任何线程都可以从 top 端 steal。
+// 所属线程也从 top 端取，保持和就绪队列一样的 FIFO 顺序
+struct work_deque {
+    _Atomic(void *) *items;
+    uint64_t mask;
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+};
+
+int init_deque(struct work_deque *deque, uint32_t cap);
+
+void deinit_deque(struct work_deque *deque);
+
+// 满了返回 false
+bool deque_push(struct work_deque *deque, void *item);
+
+// 队列为空返回 NULL，与其他线程竞争失败时会重试
+void *deque_steal(struct work_deque *deque);
+
+uint32_t deque_size(struct work_deque *deque);
+
+#endif //EPOLL_COROUTINE_DEQUE_H
@@ -8,10 +8,18 @@
 #define K 4U  // 定义四叉堆的度数
 
 
-static void swap(quad_heap_node *a, quad_heap_node *b) {
-    quad_heap_node temp = *a;
-    *a = *b;
-    *b = temp;
+static void set_index(quad_heap *heap, int64_t i) {
+    if (heap->nodes[i].index != NULL) {
+        *heap->nodes[i].index = i;
+    }
+}
+
+static void swap(quad_heap *heap, int64_t i, int64_t j) {
+    quad_heap_node temp = heap->nodes[i];
+    heap->nodes[i] = heap->nodes[j];
+    heap->nodes[j] = temp;
+    set_index(heap, i);
+    set_index(heap, j);
 }
 
 // 创建四叉堆
@@ -30,7 +38,7 @@ static int expand_quad_heap(quad_heap *heap) {
         return -1;
     }
     int64_t new_cap = heap->capacity * 2;
-    quad_heap_node *new_nodes = (quad_heap_node *) realloc(heap->nodes, sizeof(quad_heap_node) * heap->capacity);
+    quad_heap_node *new_nodes = (quad_heap_node *) realloc(heap->nodes, sizeof(quad_heap_node) * new_cap);
     if (new_nodes == NULL) {
         return -1;
     }
@@ -58,7 +66,7 @@ static int64_t min_non_leaf_idx(quad_heap *heap) {
 
 static void heap_up(quad_heap *heap, int64_t i) {
     while (i != 0 && heap->nodes[parent(i)].key > heap->nodes[i].key) {
-        swap(&heap->nodes[i], &heap->nodes[parent(i)]);
+        swap(heap, i, parent(i));
         i = parent(i);
     }
 }
@@ -76,13 +84,16 @@ static void heap_down(quad_heap *heap, int64_t i) {
         if (min_index == i) {
             break;
         }
-        swap(&heap->nodes[i], &heap->nodes[min_index]);
+        swap(heap, i, min_index);
         i = min_index;
     }
 }
 
 // 最小堆化
 void min_heapify(quad_heap *heap/*uninitialized*/) {
+    for (int64_t idx = 0; idx < heap->size; idx++) {
+        set_index(heap, idx);
+    }
     for (int64_t idx = min_non_leaf_idx(heap); idx >= 0; idx--) {
         heap_down(heap, idx);
     }
@@ -113,36 +124,48 @@ void deinit_heap(quad_heap *heap) {
 // 删除最小元素
 quad_heap_node heap_pop(quad_heap *heap) {
     if (heap->size <= 0) {
-        return (quad_heap_node) {INT64_MIN, NULL};
+        return (quad_heap_node) {INT64_MIN, NULL, NULL};
     }
-
-    if (heap->size == 1) {
-        heap->size--;
-        return heap->nodes[0];
-    }
-
     quad_heap_node root = heap->nodes[0];
-    heap->nodes[0] = heap->nodes[heap->size - 1];
-    heap->size--;
-    heap_down(heap, 0);
+    heap_remove(heap, 0);
     return root;
 }
 
 quad_heap_node heap_top(quad_heap *heap) {
     if (heap->size <= 0) {
-        return (quad_heap_node) {INT64_MIN, NULL};
+        return (quad_heap_node) {INT64_MIN, NULL, NULL};
     }
     return heap->nodes[0];
 }
 
-// 插入元素
-void heap_push(quad_heap *heap, quad_heap_node data) {
-    if (heap->size == heap->capacity) {
-        expand_quad_heap(heap);
+// 插入元素，扩容失败返回 -1
+int heap_push(quad_heap *heap, quad_heap_node data) {
+    if (heap->size == heap->capacity && expand_quad_heap(heap) != 0) {
+        return -1;
     }
     heap->nodes[heap->size] = data;
     heap->size++;
+    set_index(heap, heap->size - 1);
     heap_up(heap, heap->size - 1);
+    return 0;
+}
+
+void heap_remove(quad_heap *heap, int64_t index) {
+    if (index < 0 || index >= heap->size) {
+        return;
+    }
+    if (heap->nodes[index].index != NULL) {
+        *heap->nodes[index].index = -1;
+    }
+    heap->size--;
+    if (index == heap->size) {
+        return;
+    }
+    // 用最后一个节点填坑，它可能比原来的节点大也可能小
+    heap->nodes[index] = heap->nodes[heap->size];
+    set_index(heap, index);
+    heap_up(heap, index);
+    heap_down(heap, index);
 }
 
 
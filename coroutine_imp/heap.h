@@ -13,6 +13,8 @@
 typedef struct quad_heap_node {
     int64_t key;
     void *data;
+    // 不为 NULL 时，节点移动后写回它在堆中的下标，出堆时写 -1
+    int64_t *index;
 } quad_heap_node;
 
 typedef struct quad_heap {
@@ -30,7 +32,11 @@ bool heap_empty(quad_heap *heap);
 quad_heap_node heap_pop(quad_heap *heap);
 quad_heap_node heap_top(quad_heap *heap);
 
-void heap_push(quad_heap *heap, quad_heap_node node);
+// 扩容失败返回 -1
+int heap_push(quad_heap *heap, quad_heap_node node);
+
+// 删除下标为 index 的节点，O(log n)
+void heap_remove(quad_heap *heap, int64_t index);
 
 void print_heap(quad_heap *heap);
 
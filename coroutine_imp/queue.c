@@ -6,13 +6,24 @@
 #include <stdbool.h>
 #include "queue.h"
 
+static uint32_t round_up_pow2(uint32_t n) {
+    uint32_t cap = 1;
+    while (cap < n) {
+        cap <<= 1;
+    }
+    return cap;
+}
 
 int init_queue(struct array_queue *queue, uint32_t cap) {
+    if (cap == 0 || cap > (1u << 31)) {
+        return -1;
+    }
+    cap = round_up_pow2(cap);
     queue->coroutines = calloc(sizeof(void *), cap);
     if (queue->coroutines == NULL) {
         return -1;
     }
-    queue->cap = cap;
+    queue->mask = cap - 1;
     queue->head = 0;
     queue->tail = 0;
     return 0;
@@ -21,36 +32,55 @@ int init_queue(struct array_queue *queue, uint32_t cap) {
 void deinit_queue(struct array_queue *queue) {
     free(queue->coroutines);
     queue->coroutines = NULL;
-    queue->cap = 0;
+    queue->mask = 0;
     queue->head = 0;
     queue->tail = 0;
 }
 
-void push_queue(struct array_queue *queue, void *co) {
-    if ((queue->tail + 1) % queue->cap == queue->head) {
-        return;
+// 按顺序搬到新数组开头，head 从 0 重新开始
+static int grow_queue(struct array_queue *queue) {
+    uint32_t cap = queue->mask + 1;
+    if (cap > (1u << 30)) {
+        return -1;
+    }
+    void **coroutines = malloc(sizeof(void *) * cap * 2);
+    if (coroutines == NULL) {
+        return -1;
+    }
+    uint32_t size = queue->tail - queue->head;
+    for (uint32_t i = 0; i < size; i++) {
+        coroutines[i] = queue->coroutines[(queue->head + i) & queue->mask];
+    }
+    free(queue->coroutines);
+    queue->coroutines = coroutines;
+    queue->mask = cap * 2 - 1;
+    queue->head = 0;
+    queue->tail = size;
+    return 0;
+}
+
+int push_queue(struct array_queue *queue, void *co) {
+    if (queue->tail - queue->head > queue->mask && grow_queue(queue) != 0) {
+        return -1;
     }
-    queue->coroutines[queue->tail] = co;
-    queue->tail = (queue->tail + 1) % queue->cap;
+    queue->coroutines[queue->tail & queue->mask] = co;
+    queue->tail++;
+    return 0;
 }
 
 void *pop_queue(struct array_queue *queue) {
     if (queue->head == queue->tail) {
         return NULL;
     }
-    void *co = queue->coroutines[queue->head];
-    queue->head = (queue->head + 1) % queue->cap;
+    void *co = queue->coroutines[queue->head & queue->mask];
+    queue->head++;
     return co;
 }
 
 uint32_t queue_size(struct array_queue *queue) {
-    return (queue->tail - queue->head + queue->cap) % queue->cap;
+    return queue->tail - queue->head;
 }
 
 uint32_t queue_cvt_pos(struct array_queue *queue, uint32_t index) {
-    return (queue->head + index) % queue->cap;
-}
-
-bool queue_full(struct array_queue *queue) {
-    return (queue->tail + 1) % queue->cap == queue->head;
+    return (queue->head + index) & queue->mask;
 }
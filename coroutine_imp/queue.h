@@ -8,19 +8,22 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// 容量是 2 的幂，head 和 tail 一直递增，用 mask 取下标。满了自动扩容
 struct array_queue {
     void **coroutines;
-    uint32_t cap;
+    uint32_t mask;
     uint32_t head;
     uint32_t tail;
 };
 
 
+// cap 向上取整到 2 的幂
 int init_queue(struct array_queue *queue, uint32_t cap);
 
 void deinit_queue(struct array_queue *queue);
 
-void push_queue(struct array_queue *queue, void *co);
+// 满了先扩容一倍，扩容失败返回 -1，队列不变
+int push_queue(struct array_queue *queue, void *co);
 
 void *pop_queue(struct array_queue *queue);
 
@@ -28,6 +31,4 @@ uint32_t queue_size(struct array_queue *queue);
 
 uint32_t queue_cvt_pos(struct array_queue *queue, uint32_t index);
 
-bool queue_full(struct array_queue *queue);
-
 #endif //EPOLL_COROUTINE_QUEUE_H
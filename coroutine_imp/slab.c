@@ -0,0 +1,87 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdlib.h>
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+
+int init_slab(struct slab *slab, size_t object_size, uint32_t objects_per_region) {
+    if (object_size == 0 || objects_per_region == 0) {
+        return -1;
+    }
+    // 空闲对象里要放得下 next 指针
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    slab->object_size = (object_size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    slab->objects_per_region = objects_per_region;
+    slab->regions = NULL;
+    slab->region_count = 0;
+    slab->region_cap = 0;
+    slab->carve_ptr = NULL;
+    slab->carve_left = 0;
+    slab->free_list = NULL;
+    slab->in_use = 0;
+    return 0;
+}
+
+void deinit_slab(struct slab *slab) {
+    for (uint32_t i = 0; i < slab->region_count; i++) {
+        free(slab->regions[i]);
+    }
+    free(slab->regions);
+    slab->regions = NULL;
+    slab->region_count = 0;
+    slab->region_cap = 0;
+    slab->carve_ptr = NULL;
+    slab->carve_left = 0;
+    slab->free_list = NULL;
+    slab->in_use = 0;
+}
+
+static int new_region(struct slab *slab) {
+    if (slab->region_count == slab->region_cap) {
+        uint32_t new_cap = slab->region_cap == 0 ? 8 : slab->region_cap * 2;
+        void **new_regions = realloc(slab->regions, sizeof(void *) * new_cap);
+        if (new_regions == NULL) {
+            return -1;
+        }
+        slab->regions = new_regions;
+        slab->region_cap = new_cap;
+    }
+    void *region = aligned_alloc(SLAB_ALIGN, slab->object_size * slab->objects_per_region);
+    if (region == NULL) {
+        return -1;
+    }
+    slab->regions[slab->region_count++] = region;
+    slab->carve_ptr = region;
+    slab->carve_left = slab->objects_per_region;
+    return 0;
+}
+
+void *slab_alloc(struct slab *slab) {
+    void *object;
+    if (slab->free_list != NULL) {
+        object = slab->free_list;
+        slab->free_list = *(void **) object;
+    } else {
+        if (slab->carve_left == 0 && new_region(slab) != 0) {
+            return NULL;
+        }
+        object = slab->carve_ptr;
+        slab->carve_ptr += slab->object_size;
+        slab->carve_left--;
+    }
+    slab->in_use++;
+    return object;
+}
+
+void slab_free(struct slab *slab, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    *(void **) object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+}
@@ -0,0 +1,35 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_SLAB_H
+#define EPOLL_COROUTINE_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 定长对象分配器，一次 malloc 一整块区域再逐个切出来，
+// 释放的对象挂在 free_list 上复用，直到 deinit_slab 才把区域还给系统。只由所属线程使用
+struct slab {
+    size_t object_size;
+    uint32_t objects_per_region;
+    void **regions;
+    uint32_t region_count;
+    uint32_t region_cap;
+    char *carve_ptr;
+    uint32_t carve_left;
+    void *free_list;
+    // 当前借出去的对象个数
+    uint32_t in_use;
+};
+
+int init_slab(struct slab *slab, size_t object_size, uint32_t objects_per_region);
+
+void deinit_slab(struct slab *slab);
+
+// 返回的对象按 16 字节对齐，内容未初始化
+void *slab_alloc(struct slab *slab);
+
+void slab_free(struct slab *slab, void *object);
+
+#endif //EPOLL_COROUTINE_SLAB_H
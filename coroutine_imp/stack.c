@@ -0,0 +1,100 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "stack.h"
+
+static size_t page_size() {
+    static size_t size = 0;
+    if (size == 0) {
+        size = (size_t) sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+int init_stack_pool(struct stack_pool *pool, size_t stack_size, uint32_t stacks_per_region) {
+    size_t page = page_size();
+    if (stack_size == 0 || stacks_per_region == 0) {
+        return -1;
+    }
+    pool->stack_size = (stack_size + page - 1) / page * page;
+    pool->slot_size = pool->stack_size + page;
+    pool->stacks_per_region = stacks_per_region;
+    pool->regions = NULL;
+    pool->region_count = 0;
+    pool->region_cap = 0;
+    pool->carve_ptr = NULL;
+    pool->carve_left = 0;
+    pool->free_list = NULL;
+    pool->unguarded = 0;
+    return 0;
+}
+
+void deinit_stack_pool(struct stack_pool *pool) {
+    for (uint32_t i = 0; i < pool->region_count; i++) {
+        munmap(pool->regions[i], pool->slot_size * pool->stacks_per_region);
+    }
+    free(pool->regions);
+    pool->regions = NULL;
+    pool->region_count = 0;
+    pool->region_cap = 0;
+    pool->carve_ptr = NULL;
+    pool->carve_left = 0;
+    pool->free_list = NULL;
+}
+
+static int new_region(struct stack_pool *pool) {
+    if (pool->region_count == pool->region_cap) {
+        uint32_t new_cap = pool->region_cap == 0 ? 8 : pool->region_cap * 2;
+        void **new_regions = realloc(pool->regions, sizeof(void *) * new_cap);
+        if (new_regions == NULL) {
+            return -1;
+        }
+        pool->regions = new_regions;
+        pool->region_cap = new_cap;
+    }
+    size_t len = pool->slot_size * pool->stacks_per_region;
+    // 只预留地址空间，切出栈时再按需开放读写
+    void *region = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        return -1;
+    }
+    pool->regions[pool->region_count++] = region;
+    pool->carve_ptr = region;
+    pool->carve_left = pool->stacks_per_region;
+    return 0;
+}
+
+void *stack_pool_alloc(struct stack_pool *pool) {
+    if (pool->free_list != NULL) {
+        void *stack = pool->free_list;
+        pool->free_list = *(void **) stack;
+        return stack;
+    }
+    if (pool->carve_left == 0 && new_region(pool) != 0) {
+        return NULL;
+    }
+    char *slot = pool->carve_ptr;
+    if (mprotect(slot + page_size(), pool->stack_size, PROT_READ | PROT_WRITE) != 0) {
+        // 保护页会拆分 VMA，超过 vm.max_map_count 时把保护页一起开放，
+        // 与相邻的栈合并成同一个 VMA，退化为无保护页的栈
+        if (mprotect(slot, pool->slot_size, PROT_READ | PROT_WRITE) != 0) {
+            return NULL;
+        }
+        pool->unguarded++;
+    }
+    pool->carve_ptr += pool->slot_size;
+    pool->carve_left--;
+    return slot + page_size();
+}
+
+void stack_pool_free(struct stack_pool *pool, void *stack) {
+    if (stack == NULL) {
+        return;
+    }
+    // 空闲链表的 next 指针直接存在栈底
+    *(void **) stack = pool->free_list;
+    pool->free_list = stack;
+}
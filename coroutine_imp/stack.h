@@ -0,0 +1,35 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_STACK_H
+#define EPOLL_COROUTINE_STACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 从大块预留区域中切出协程栈，每个栈下方有一页 PROT_NONE 保护页
+// 回收的栈挂在 free_list 上，不再 munmap，直到 deinit_stack_pool
+struct stack_pool {
+    size_t stack_size;
+    size_t slot_size;
+    uint32_t stacks_per_region;
+    void **regions;
+    uint32_t region_count;
+    uint32_t region_cap;
+    char *carve_ptr;
+    uint32_t carve_left;
+    void *free_list;
+    uint32_t unguarded;
+};
+
+int init_stack_pool(struct stack_pool *pool, size_t stack_size, uint32_t stacks_per_region);
+
+void deinit_stack_pool(struct stack_pool *pool);
+
+// 返回栈的最低可用地址，可用长度为 pool->stack_size
+void *stack_pool_alloc(struct stack_pool *pool);
+
+void stack_pool_free(struct stack_pool *pool, void *stack);
+
+#endif //EPOLL_COROUTINE_STACK_H
@@ -0,0 +1,163 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_uring_setup(uint32_t entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+                           void *arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int map_rings(struct uring *ring, struct io_uring_params *params) {
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        // 提交队列和完成队列共用一次映射
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        return -1;
+    }
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            return -1;
+        }
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        return -1;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_khead = (uint32_t *) (sq + params->sq_off.head);
+    ring->sq_ktail = (uint32_t *) (sq + params->sq_off.tail);
+    ring->sq_kmask = (uint32_t *) (sq + params->sq_off.ring_mask);
+    ring->cq_khead = (uint32_t *) (cq + params->cq_off.head);
+    ring->cq_ktail = (uint32_t *) (cq + params->cq_off.tail);
+    ring->cq_kmask = (uint32_t *) (cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+    // sqe 下标和 array 下标一一对应，之后不再改
+    uint32_t *array = (uint32_t *) (sq + params->sq_off.array);
+    for (uint32_t i = 0; i < params->sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->sq_entries = params->sq_entries;
+    ring->sqe_tail = *ring->sq_ktail;
+    return 0;
+}
+
+int init_uring(struct uring *ring, uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = sys_uring_setup(entries, &params);
+    if (ring->fd == -1 && errno == EINVAL) {
+        // 老内核不认识这些标志
+        memset(&params, 0, sizeof(params));
+        ring->fd = sys_uring_setup(entries, &params);
+    }
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->features = params.features;
+    // 等待时要带超时，需要 5.11 之后的 IORING_ENTER_EXT_ARG
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        ring->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+    if (map_rings(ring, &params) != 0) {
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void deinit_uring(struct uring *ring) {
+    if (ring->fd == -1) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+uint32_t uring_sq_space(struct uring *ring) {
+    uint32_t head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+    return ring->sq_entries - (ring->sqe_tail - head);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (uring_sq_space(ring) == 0) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_kmask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_enter(struct uring *ring, uint32_t wait_nr, struct __kernel_timespec *timeout) {
+    __atomic_store_n(ring->sq_ktail, ring->sqe_tail, __ATOMIC_RELEASE);
+    uint32_t to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    uint32_t flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (wait_nr > 0 && timeout != NULL) {
+        struct io_uring_getevents_arg arg = {
+                .sigmask = 0,
+                .sigmask_sz = _NSIG / 8,
+                .ts = (uint64_t) (uintptr_t) timeout,
+        };
+        ret = sys_uring_enter(ring->fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = sys_uring_enter(ring->fd, to_submit, wait_nr, flags, NULL, _NSIG / 8);
+    }
+    return ret == -1 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    uint32_t head = *ring->cq_khead;
+    if (head == __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_kmask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_khead, *ring->cq_khead + 1, __ATOMIC_RELEASE);
+}
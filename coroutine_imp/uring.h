@@ -0,0 +1,52 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_URING_H
+#define EPOLL_COROUTINE_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// 直接用系统调用操作 io_uring，不依赖 liburing。只由所属线程使用
+struct uring {
+    int fd;
+    uint32_t features;
+    uint32_t sq_entries;
+    uint32_t *sq_khead;
+    uint32_t *sq_ktail;
+    uint32_t *sq_kmask;
+    // 已经填好但还没提交给内核的 sqe 的结尾
+    uint32_t sqe_tail;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_khead;
+    uint32_t *cq_ktail;
+    uint32_t *cq_kmask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+int init_uring(struct uring *ring, uint32_t entries);
+
+void deinit_uring(struct uring *ring);
+
+// 提交队列满了返回 NULL，返回的 sqe 已经清零
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+uint32_t uring_sq_space(struct uring *ring);
+
+// 提交所有已填好的 sqe，wait_nr 不为 0 时最多等 timeout（NULL 表示一直等）。
+// 返回提交的个数，失败返回 -errno，等待超时为 -ETIME
+int uring_enter(struct uring *ring, uint32_t wait_nr, struct __kernel_timespec *timeout);
+
+// 没有完成事件时返回 NULL，处理完要调用 uring_cqe_seen
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+#endif //EPOLL_COROUTINE_URING_H
@@ -0,0 +1,214 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stddef.h>
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+// 超出最高层范围的定时器先挂在最高层最远的格子上，下放时再重新计算
+#define WHEEL_SPAN ((int64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define DUE_LEVEL WHEEL_LEVELS
+
+void init_wheel(struct timer_wheel *wheel, int64_t tick_ns, int64_t now) {
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        wheel->bitmap[l] = 0;
+        for (int s = 0; s < WHEEL_SLOTS; s++) {
+            wheel->slots[l][s] = NULL;
+        }
+    }
+    wheel->tick_ns = tick_ns;
+    wheel->now_tick = now / tick_ns;
+    wheel->count = 0;
+    wheel->due = NULL;
+}
+
+bool wheel_empty(struct timer_wheel *wheel) {
+    return wheel->count == 0 && wheel->due == NULL;
+}
+
+static struct wheel_node **slot_head(struct timer_wheel *wheel, int level, int slot) {
+    if (level == DUE_LEVEL) {
+        return &wheel->due;
+    }
+    return &wheel->slots[level][slot];
+}
+
+static void link_node(struct timer_wheel *wheel, struct wheel_node *node, int level, int slot) {
+    struct wheel_node **head = slot_head(wheel, level, slot);
+    node->level = level;
+    node->slot = slot;
+    node->prev = NULL;
+    node->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = node;
+    }
+    *head = node;
+    node->linked = true;
+    if (level != DUE_LEVEL) {
+        wheel->bitmap[level] |= (uint64_t) 1 << slot;
+        wheel->count++;
+    }
+}
+
+static void place_node(struct timer_wheel *wheel, struct wheel_node *node) {
+    int64_t delta = node->expire_tick - wheel->now_tick;
+    if (delta < 0) {
+        link_node(wheel, node, DUE_LEVEL, 0);
+        return;
+    }
+    int64_t tick = node->expire_tick;
+    if (delta >= WHEEL_SPAN) {
+        tick = wheel->now_tick + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while (delta >= (int64_t) 1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    link_node(wheel, node, level, (int) (tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+}
+
+void wheel_add(struct timer_wheel *wheel, struct wheel_node *node, int64_t expire, void *data) {
+    node->expire = expire;
+    // 向上取整到 tick，定时器只会晚到不会早到
+    node->expire_tick = (expire + wheel->tick_ns - 1) / wheel->tick_ns;
+    node->data = data;
+    if (node->expire_tick <= wheel->now_tick) {
+        link_node(wheel, node, DUE_LEVEL, 0);
+        return;
+    }
+    place_node(wheel, node);
+}
+
+void wheel_remove(struct timer_wheel *wheel, struct wheel_node *node) {
+    if (!node->linked) {
+        return;
+    }
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        *slot_head(wheel, node->level, node->slot) = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    if (node->level != DUE_LEVEL) {
+        if (wheel->slots[node->level][node->slot] == NULL) {
+            wheel->bitmap[node->level] &= ~((uint64_t) 1 << node->slot);
+        }
+        wheel->count--;
+    }
+    node->prev = NULL;
+    node->next = NULL;
+    node->linked = false;
+}
+
+static struct wheel_node *detach_slot(struct timer_wheel *wheel, int level, int slot) {
+    struct wheel_node **head = slot_head(wheel, level, slot);
+    struct wheel_node *list = *head;
+    *head = NULL;
+    if (level != DUE_LEVEL) {
+        wheel->bitmap[level] &= ~((uint64_t) 1 << slot);
+    }
+    for (struct wheel_node *node = list; node != NULL; node = node->next) {
+        node->linked = false;
+        if (level != DUE_LEVEL) {
+            wheel->count--;
+        }
+    }
+    return list;
+}
+
+// 低层转完一圈，把高层当前格子里的节点重新分配到低层
+static void cascade(struct timer_wheel *wheel) {
+    for (int l = 1; l < WHEEL_LEVELS; l++) {
+        int slot = (int) (wheel->now_tick >> (WHEEL_BITS * l)) & WHEEL_MASK;
+        struct wheel_node *node = detach_slot(wheel, l, slot);
+        while (node != NULL) {
+            struct wheel_node *next = node->next;
+            place_node(wheel, node);
+            node = next;
+        }
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+static void append_list(struct wheel_node **head, struct wheel_node **tail, struct wheel_node *list) {
+    while (list != NULL) {
+        struct wheel_node *next = list->next;
+        list->prev = NULL;
+        list->next = NULL;
+        if (*tail == NULL) {
+            *head = list;
+        } else {
+            (*tail)->next = list;
+        }
+        *tail = list;
+        list = next;
+    }
+}
+
+struct wheel_node *wheel_expire(struct timer_wheel *wheel, int64_t now) {
+    struct wheel_node *head = NULL, *tail = NULL;
+    append_list(&head, &tail, detach_slot(wheel, DUE_LEVEL, 0));
+    int64_t target = now / wheel->tick_ns;
+    while (wheel->now_tick < target) {
+        if (wheel->count == 0) {
+            wheel->now_tick = target;
+            break;
+        }
+        // 直接跳到第 0 层下一个非空格子，或者下一次下放的位置
+        int pos = (int) (wheel->now_tick & WHEEL_MASK);
+        uint64_t later = pos == WHEEL_MASK ? 0 : wheel->bitmap[0] & (~(uint64_t) 0 << (pos + 1));
+        int64_t next;
+        if (later != 0) {
+            next = wheel->now_tick - pos + __builtin_ctzll(later);
+        } else {
+            next = (wheel->now_tick | WHEEL_MASK) + 1;
+        }
+        if (next > target) {
+            wheel->now_tick = target;
+            break;
+        }
+        wheel->now_tick = next;
+        int slot = (int) (next & WHEEL_MASK);
+        if (slot == 0) {
+            cascade(wheel);
+        }
+        append_list(&head, &tail, detach_slot(wheel, 0, slot));
+    }
+    return head;
+}
+
+int64_t wheel_next_expire(struct timer_wheel *wheel) {
+    if (wheel->due != NULL) {
+        return wheel->now_tick * wheel->tick_ns;
+    }
+    if (wheel->count == 0) {
+        return -1;
+    }
+    int64_t best = INT64_MAX;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        uint64_t bitmap = wheel->bitmap[l];
+        if (bitmap == 0) {
+            continue;
+        }
+        int shift = WHEEL_BITS * l;
+        int64_t high = wheel->now_tick >> shift;
+        int pos = (int) (high & WHEEL_MASK);
+        uint64_t later = pos == WHEEL_MASK ? 0 : bitmap & (~(uint64_t) 0 << (pos + 1));
+        int64_t distance;
+        if (later != 0) {
+            distance = __builtin_ctzll(later) - pos;
+        } else {
+            distance = __builtin_ctzll(bitmap) + WHEEL_SLOTS - pos;
+        }
+        int64_t tick = (high + distance) << shift;
+        if (tick < best) {
+            best = tick;
+        }
+    }
+    return best * wheel->tick_ns;
+}
@@ -0,0 +1,54 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_WHEEL_H
+#define EPOLL_COROUTINE_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+
+// 侵入式定时器节点，由调用者持有，挂在时间轮上期间不能释放
+struct wheel_node {
+    int64_t expire;
+    int64_t expire_tick;
+    struct wheel_node *prev;
+    struct wheel_node *next;
+    void *data;
+    uint8_t level;
+    uint8_t slot;
+    bool linked;
+};
+
+// 分层时间轮：第 l 层每格 64^l 个 tick，共 5 层。插入和删除 O(1)，
+// 高层的格子在低层转完一圈时整体下放到低层
+struct timer_wheel {
+    int64_t tick_ns;
+    // 小于等于 now_tick 的 tick 都已经处理过
+    int64_t now_tick;
+    int64_t count;
+    uint64_t bitmap[WHEEL_LEVELS];
+    struct wheel_node *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    // 插入时已经过期的节点，下次 wheel_expire 直接取走
+    struct wheel_node *due;
+};
+
+void init_wheel(struct timer_wheel *wheel, int64_t tick_ns, int64_t now);
+
+bool wheel_empty(struct timer_wheel *wheel);
+
+void wheel_add(struct timer_wheel *wheel, struct wheel_node *node, int64_t expire, void *data);
+
+void wheel_remove(struct timer_wheel *wheel, struct wheel_node *node);
+
+// 把到 now 为止到期的节点摘下来，通过 next 串成链表返回
+struct wheel_node *wheel_expire(struct timer_wheel *wheel, int64_t now);
+
+// 最早可能到期的时间，高层格子只能给出下放的时间；没有定时器时返回 -1
+int64_t wheel_next_expire(struct timer_wheel *wheel);
+
+#endif //EPOLL_COROUTINE_WHEEL_H
@@ -0,0 +1,353 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <string.h>
+#include <strings.h>
+#include "http_parser.h"
+#include "http_scan.h"
+
+enum chunk_state {
+    CHUNK_SIZE = 0,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+};
+
+// 分块大小最多 15 位十六进制，避免溢出
+#define MAX_CHUNK_DIGITS 15
+
+void http_parser_init(struct http_parser *parser) {
+    memset(parser, 0, sizeof(*parser));
+    parser->content_length = -1;
+}
+
+bool http_name_equal(const char *s, const char *lower, size_t len) {
+    // 8 字节一组同时转小写比较，tchar 里只有 '^' 和 '~' 会被当成相同
+    const uint64_t fold = 0x2020202020202020ULL;
+    while (len >= 8) {
+        uint64_t a, b;
+        memcpy(&a, s, 8);
+        memcpy(&b, lower, 8);
+        if ((a | fold) != b) {
+            return false;
+        }
+        s += 8;
+        lower += 8;
+        len -= 8;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if ((s[i] | 0x20) != lower[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool http_token_equal(const char *s, size_t len, const char *token) {
+    return strlen(token) == len && strncasecmp(s, token, len) == 0;
+}
+
+const struct http_header *http_find_header(const struct http_request *req, const char *name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (http_token_equal(req->headers[i].name, req->headers[i].name_len, name)) {
+            return &req->headers[i];
+        }
+    }
+    return NULL;
+}
+
+static const char *find_crlf(const char *p, const char *end) {
+    for (; p + 1 < end; p++) {
+        if (p[0] == '\r' && p[1] == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Connection 头是逗号分隔的 token 列表
+static void parse_connection(struct http_request *req, const char *value, size_t len) {
+    const char *p = value, *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if (http_token_equal(start, p - start, "close")) {
+            req->keep_alive = false;
+        } else if (http_token_equal(start, p - start, "keep-alive")) {
+            req->keep_alive = true;
+        }
+    }
+}
+
+static int64_t parse_content_length(const char *value, size_t len) {
+    if (len == 0 || len > 18) {
+        return -1;
+    }
+    int64_t result = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        result = result * 10 + (value[i] - '0');
+    }
+    return result;
+}
+
+static int fail(struct http_parser *parser, int status) {
+    parser->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+// 形如 HTTP/x.y 的版本号，只是不支持时才回 505
+static bool version_well_formed(const char *p, const char *end) {
+    return end - p >= 10 && memcmp(p, "HTTP/", 5) == 0 && p[5] >= '0' && p[5] <= '9' && p[6] == '.' &&
+           p[7] >= '0' && p[7] <= '9' && p[8] == '\r' && p[9] == '\n';
+}
+
+static int parse_request_line(struct http_parser *parser, const char *p, const char *end,
+                              struct http_request *req, const char **next) {
+    const char *q = http_scan(p, end, HTTP_CLASS_TOKEN);
+    if (q == p || *q != ' ') {
+        return fail(parser, 400);
+    }
+    req->method = p;
+    req->method_len = q - p;
+    p = q + 1;
+    q = http_scan(p, end, HTTP_CLASS_TARGET);
+    if (q == p || *q != ' ') {
+        return fail(parser, 400);
+    }
+    req->path = p;
+    req->path_len = q - p;
+    p = q + 1;
+    if (end - p < 10 || memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1') ||
+        p[8] != '\r' || p[9] != '\n') {
+        return fail(parser, version_well_formed(p, end) ? 505 : 400);
+    }
+    req->minor_version = p[7] - '0';
+    *next = p + 10;
+    return 0;
+}
+
+static int parse_header_line(struct http_parser *parser, const char *p, const char *end,
+                             struct http_request *req, const char **next) {
+    // 不支持 obs-fold，名字和冒号之间也不允许空白
+    const char *q = http_scan(p, end, HTTP_CLASS_TOKEN);
+    if (q == p || *q != ':') {
+        return fail(parser, 400);
+    }
+    if (req->header_count == HTTP_MAX_HEADERS) {
+        return fail(parser, 431);
+    }
+    struct http_header *header = &req->headers[req->header_count++];
+    header->name = p;
+    header->name_len = q - p;
+    p = q + 1;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    // 头部以 "\r\n\r\n" 结尾，扫描一定会停在某个 '\r' 上
+    q = http_scan(p, end, HTTP_CLASS_VALUE);
+    if (q + 1 >= end || q[0] != '\r' || q[1] != '\n') {
+        return fail(parser, 400);
+    }
+    *next = q + 2;
+    while (q > p && (q[-1] == ' ' || q[-1] == '\t')) {
+        q--;
+    }
+    header->value = p;
+    header->value_len = q - p;
+    return 0;
+}
+
+// 只关心影响正文边界和连接的几个头部，先按长度分开，少做比较
+static int apply_header(struct http_parser *parser, struct http_request *req, const struct http_header *header) {
+    switch (header->name_len) {
+        case 14:
+            if (http_name_equal(header->name, "content-length", 14)) {
+                int64_t length = parse_content_length(header->value, header->value_len);
+                if (length < 0 || (parser->content_length >= 0 && parser->content_length != length)) {
+                    return fail(parser, 400);
+                }
+                parser->content_length = length;
+            }
+            break;
+        case 17:
+            if (http_name_equal(header->name, "transfer-encoding", 17)) {
+                // 只支持单独的 chunked
+                if (!http_token_equal(header->value, header->value_len, "chunked")) {
+                    return fail(parser, 501);
+                }
+                parser->chunked = true;
+            }
+            break;
+        case 10:
+            if (http_name_equal(header->name, "connection", 10)) {
+                parse_connection(req, header->value, header->value_len);
+            }
+            break;
+        case 6:
+            if (http_name_equal(header->name, "expect", 6)) {
+                req->expect_continue = http_token_equal(header->value, header->value_len, "100-continue");
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// 解析头部并确定正文的边界。头部完整之后每次都可以重新调用，用来刷新指针
+static int parse_head(struct http_parser *parser, const char *buf, struct http_request *req) {
+    const char *end = buf + parser->head_len;
+    const char *p;
+    if (parse_request_line(parser, buf, end, req, &p) != 0) {
+        return HTTP_PARSE_ERROR;
+    }
+    req->header_count = 0;
+    req->keep_alive = req->minor_version == 1;
+    req->expect_continue = false;
+    parser->content_length = -1;
+    parser->chunked = false;
+    // 最后两个字节是空行
+    while (p < end - 2) {
+        if (parse_header_line(parser, p, end, req, &p) != 0 ||
+            apply_header(parser, req, &req->headers[req->header_count - 1]) != 0) {
+            return HTTP_PARSE_ERROR;
+        }
+    }
+    // 两个都有时无法确定边界，直接拒绝，防止请求走私
+    if (parser->chunked && parser->content_length >= 0) {
+        return fail(parser, 400);
+    }
+    parser->expect_continue = req->expect_continue;
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// 原地解码分块正文，解码后的数据从 body 开头连续存放。完成返回 0
+static int decode_chunked(struct http_parser *parser, char *body, size_t len) {
+    while (true) {
+        char *p = body + parser->chunk_src;
+        char *end = body + len;
+        switch (parser->chunk_state) {
+            case CHUNK_SIZE: {
+                const char *line_end = find_crlf(p, end);
+                if (line_end == NULL) {
+                    return HTTP_PARSE_INCOMPLETE;
+                }
+                size_t size = 0;
+                int digits = 0;
+                for (; p < line_end && hex_value(*p) >= 0; p++, digits++) {
+                    size = size * 16 + hex_value(*p);
+                }
+                // 分块扩展直接忽略
+                if (digits == 0 || digits > MAX_CHUNK_DIGITS || (p < line_end && *p != ';' && *p != ' ')) {
+                    return fail(parser, 400);
+                }
+                parser->chunk_src = line_end + 2 - body;
+                parser->chunk_remaining = size;
+                parser->chunk_state = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+                break;
+            }
+            case CHUNK_DATA: {
+                size_t avail = end - p;
+                size_t n = avail < parser->chunk_remaining ? avail : parser->chunk_remaining;
+                memmove(body + parser->chunk_dst, p, n);
+                parser->chunk_dst += n;
+                parser->chunk_src += n;
+                parser->chunk_remaining -= n;
+                if (parser->chunk_remaining > 0) {
+                    return HTTP_PARSE_INCOMPLETE;
+                }
+                parser->chunk_state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (end - p < 2) {
+                    return HTTP_PARSE_INCOMPLETE;
+                }
+                if (p[0] != '\r' || p[1] != '\n') {
+                    return fail(parser, 400);
+                }
+                parser->chunk_src += 2;
+                parser->chunk_state = CHUNK_SIZE;
+                break;
+            case CHUNK_TRAILER: {
+                // trailer 字段不交给处理函数，读到空行为止
+                const char *line_end = find_crlf(p, end);
+                if (line_end == NULL) {
+                    return HTTP_PARSE_INCOMPLETE;
+                }
+                parser->chunk_src = line_end + 2 - body;
+                if (line_end == p) {
+                    return 0;
+                }
+                break;
+            }
+            default:
+                return fail(parser, 400);
+        }
+    }
+}
+
+ssize_t http_parse_request(struct http_parser *parser, char *buf, size_t len, struct http_request *req) {
+    bool head_fresh = false;
+    if (parser->head_len == 0) {
+        // 回退 3 个字节，"\r\n\r\n" 可能跨两次读取
+        size_t from = parser->scanned > 3 ? parser->scanned - 3 : 0;
+        size_t head_len = http_find_head_end(buf, from, len);
+        if (head_len == 0) {
+            parser->scanned = len;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        parser->head_len = head_len;
+        if (parse_head(parser, buf, req) != 0) {
+            return HTTP_PARSE_ERROR;
+        }
+        head_fresh = true;
+    }
+    char *body = buf + parser->head_len;
+    size_t body_avail = len - parser->head_len;
+    size_t body_len, consumed;
+    if (parser->chunked) {
+        int ret = decode_chunked(parser, body, body_avail);
+        if (ret != 0) {
+            return ret;
+        }
+        body_len = parser->chunk_dst;
+        consumed = parser->chunk_src;
+    } else {
+        body_len = parser->content_length > 0 ? (size_t) parser->content_length : 0;
+        if (body_avail < body_len) {
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        consumed = body_len;
+    }
+    // 正文跨了多次读取，缓冲区可能已经移动过，重新取一遍头部的指针
+    if (!head_fresh) {
+        parse_head(parser, buf, req);
+    }
+    req->body = body;
+    req->body_len = body_len;
+    size_t total = parser->head_len + consumed;
+    http_parser_init(parser);
+    return (ssize_t) total;
+}
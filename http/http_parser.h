@@ -0,0 +1,79 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_HTTP_PARSER_H
+#define EPOLL_COROUTINE_HTTP_PARSER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HTTP_MAX_HEADERS 32
+
+// 请求里的字符串都指向调用者的缓冲区，不以 '\0' 结尾
+struct http_header {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+struct http_request {
+    const char *method;
+    size_t method_len;
+    const char *path;
+    size_t path_len;
+    // HTTP/1.x 的 x
+    int minor_version;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int header_count;
+    bool keep_alive;
+    bool expect_continue;
+    // 分块传输的正文已经原地解码
+    const char *body;
+    size_t body_len;
+};
+
+enum http_parse_status {
+    HTTP_PARSE_INCOMPLETE = -1,
+    HTTP_PARSE_ERROR = -2,
+};
+
+// 增量解析的状态。数据不完整时保留已经扫描过的位置，下次只看新到的数据；
+// 缓冲区可以在两次调用之间整体移动，状态里只记相对请求开头的偏移
+struct http_parser {
+    // 查找头部结尾时已经扫描过的长度
+    size_t scanned;
+    // 头部长度（含空行），0 表示头部还不完整
+    size_t head_len;
+    int64_t content_length;
+    bool chunked;
+    bool expect_continue;
+    // 分块解码的状态，偏移相对正文开头
+    int chunk_state;
+    size_t chunk_remaining;
+    size_t chunk_src;
+    size_t chunk_dst;
+    // 出错时建议返回的状态码
+    int error_status;
+};
+
+void http_parser_init(struct http_parser *parser);
+
+// 解析 buf 开头的一个请求。完整时返回请求占用的字节数并填好 req，parser 自动复位；
+// 不完整返回 HTTP_PARSE_INCOMPLETE，补充数据后用同一个 parser 和同样开头的数据再调用；
+// 出错返回 HTTP_PARSE_ERROR，状态码在 parser->error_status。分块正文会原地改写 buf
+ssize_t http_parse_request(struct http_parser *parser, char *buf, size_t len, struct http_request *req);
+
+// 按名字查找头部（不区分大小写），找不到返回 NULL
+const struct http_header *http_find_header(const struct http_request *req, const char *name);
+
+// 忽略大小写比较 token
+bool http_token_equal(const char *s, size_t len, const char *token);
+
+// s 是合法的 token，lower 是全小写的 token，两者长度都是 len
+bool http_name_equal(const char *s, const char *lower, size_t len);
+
+#endif //EPOLL_COROUTINE_HTTP_PARSER_H
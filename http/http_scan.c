@@ -0,0 +1,285 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <string.h>
+#include <stdint.h>
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+struct scan_ops {
+    enum http_scan_kind kind;
+    const char *(*scan)(const char *p, const char *end, enum http_char_class cls);
+    size_t (*find_head_end)(const char *buf, size_t from, size_t len);
+};
+
+// 每个类别一张 256 字节的表，标量实现直接查，SIMD 实现用来确认候选位置
+static bool class_table[HTTP_CLASS_COUNT][256];
+
+static bool is_tchar(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static bool class_contains(unsigned char c, enum http_char_class cls) {
+    switch (cls) {
+        case HTTP_CLASS_TOKEN:
+            return is_tchar(c);
+        case HTTP_CLASS_TARGET:
+            return c > ' ' && c < 0x7f;
+        case HTTP_CLASS_VALUE:
+            return c == '\t' || (c >= ' ' && c != 0x7f);
+        default:
+            return false;
+    }
+}
+
+bool http_char_in_class(unsigned char c, enum http_char_class cls) {
+    return class_table[cls][c];
+}
+
+static const char *scan_scalar(const char *p, const char *end, enum http_char_class cls) {
+    const bool *table = class_table[cls];
+    while (p < end && table[(unsigned char) *p]) {
+        p++;
+    }
+    return p;
+}
+
+// 先找 '\n'，再看前面三个字节
+static size_t check_head_end(const char *buf, size_t from, size_t pos) {
+    if (pos >= from + 3 && buf[pos - 1] == '\r' && buf[pos - 2] == '\n' && buf[pos - 3] == '\r') {
+        return pos + 1;
+    }
+    return 0;
+}
+
+static size_t find_head_end_scalar(const char *buf, size_t from, size_t len) {
+    size_t pos = from + 3;
+    while (pos < len) {
+        const char *lf = memchr(buf + pos, '\n', len - pos);
+        if (lf == NULL) {
+            return 0;
+        }
+        pos = lf - buf;
+        size_t head_len = check_head_end(buf, from, pos);
+        if (head_len != 0) {
+            return head_len;
+        }
+        pos++;
+    }
+    return 0;
+}
+
+#ifdef HTTP_SCAN_X86
+
+// SSE4.2 的 PCMPESTRI 最多 8 个区间，token 的非法字符放不下，'{' 到 0xff 合成一段，
+// 命中后再查表确认，'|' 和 '~' 会被跳过
+static const char sse42_ranges[HTTP_CLASS_COUNT][16] = {
+        [HTTP_CLASS_TOKEN] = "\x00\x20\"\"()" ",,//:@[]{\xff",
+        [HTTP_CLASS_TARGET] = "\x00\x20\x7f\xff",
+        [HTTP_CLASS_VALUE] = "\x00\x08\x0a\x1f\x7f\x7f",
+};
+static const int sse42_range_len[HTTP_CLASS_COUNT] = {
+        [HTTP_CLASS_TOKEN] = 16,
+        [HTTP_CLASS_TARGET] = 4,
+        [HTTP_CLASS_VALUE] = 6,
+};
+
+__attribute__((target("sse4.2")))
+static const char *scan_sse42(const char *p, const char *end, enum http_char_class cls) {
+    const bool *table = class_table[cls];
+    __m128i ranges = _mm_loadu_si128((const __m128i *) sse42_ranges[cls]);
+    int range_len = sse42_range_len[cls];
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        int i = _mm_cmpestri(ranges, range_len, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (i == 16) {
+            p += 16;
+            continue;
+        }
+        if (!table[(unsigned char) p[i]]) {
+            return p + i;
+        }
+        p += i + 1;
+    }
+    return scan_scalar(p, end, cls);
+}
+
+static size_t find_head_end_sse2(const char *buf, size_t from, size_t len) {
+    size_t pos = from + 3;
+    __m128i lf = _mm_set1_epi8('\n');
+    while (pos + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + pos));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        while (mask != 0) {
+            size_t head_len = check_head_end(buf, from, pos + __builtin_ctz(mask));
+            if (head_len != 0) {
+                return head_len;
+            }
+            mask &= mask - 1;
+        }
+        pos += 16;
+    }
+    return pos < len ? find_head_end_scalar(buf, pos - 3, len) : 0;
+}
+
+// AVX2 按高低半字节查表分类：低半字节查出一个位图，第 h 位表示高半字节为 h 的字符非法，
+// 高半字节再查出 1 << h，两者相与不为 0 就是非法字符。0x80 以上单独用符号位处理
+static uint8_t avx2_low_table[HTTP_CLASS_COUNT][16];
+static bool avx2_high_bad[HTTP_CLASS_COUNT];
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, enum http_char_class cls) {
+    __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) avx2_low_table[cls]));
+    __m256i high_bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                         1, 2, 4, 8, 16, 32, 64, (char) 128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i zero = _mm256_setzero_si256();
+    bool high_bad = avx2_high_bad[cls];
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+        __m256i high = _mm256_shuffle_epi8(high_bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        uint32_t good = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(low, high), zero));
+        uint32_t bad = ~good;
+        if (high_bad) {
+            bad |= (uint32_t) _mm256_movemask_epi8(v);
+        }
+        if (bad != 0) {
+            return p + __builtin_ctz(bad);
+        }
+        p += 32;
+    }
+    // 不能落到 scan_sse42：非 VEX 编码的 SSE 指令和脏的 YMM 高位混用会有很大的切换开销
+    if (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i nibble128 = _mm256_castsi256_si128(nibble);
+        __m128i low = _mm_shuffle_epi8(_mm256_castsi256_si128(low_table), _mm_and_si128(v, nibble128));
+        __m128i high = _mm_shuffle_epi8(_mm256_castsi256_si128(high_bits),
+                                        _mm_and_si128(_mm_srli_epi16(v, 4), nibble128));
+        __m128i flagged = _mm_and_si128(low, high);
+        uint32_t good = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(flagged, _mm_setzero_si128()));
+        uint32_t bad = ~good & 0xffff;
+        if (high_bad) {
+            bad |= (uint32_t) _mm_movemask_epi8(v);
+        }
+        if (bad != 0) {
+            return p + __builtin_ctz(bad);
+        }
+        p += 16;
+    }
+    return scan_scalar(p, end, cls);
+}
+
+__attribute__((target("avx2")))
+static size_t find_head_end_avx2(const char *buf, size_t from, size_t len) {
+    size_t pos = from + 3;
+    __m256i lf = _mm256_set1_epi8('\n');
+    while (pos + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + pos));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        while (mask != 0) {
+            size_t head_len = check_head_end(buf, from, pos + __builtin_ctz(mask));
+            if (head_len != 0) {
+                return head_len;
+            }
+            mask &= mask - 1;
+        }
+        pos += 32;
+    }
+    return pos < len ? find_head_end_scalar(buf, pos - 3, len) : 0;
+}
+
+#endif
+
+static const struct scan_ops scan_impls[] = {
+        [HTTP_SCAN_SCALAR] = {HTTP_SCAN_SCALAR, scan_scalar, find_head_end_scalar},
+#ifdef HTTP_SCAN_X86
+        [HTTP_SCAN_SSE42] = {HTTP_SCAN_SSE42, scan_sse42, find_head_end_sse2},
+        [HTTP_SCAN_AVX2] = {HTTP_SCAN_AVX2, scan_avx2, find_head_end_avx2},
+#endif
+};
+
+static const struct scan_ops *scan_ops = &scan_impls[HTTP_SCAN_SCALAR];
+
+static bool cpu_supports(enum http_scan_kind kind) {
+    switch (kind) {
+        case HTTP_SCAN_SCALAR:
+            return true;
+#ifdef HTTP_SCAN_X86
+        case HTTP_SCAN_SSE42:
+            return __builtin_cpu_supports("sse4.2");
+        case HTTP_SCAN_AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+#endif
+        default:
+            return false;
+    }
+}
+
+// 在 main 之前建表并选择实现，之后解析时只读
+__attribute__((constructor))
+static void init_scan() {
+    for (int cls = 0; cls < HTTP_CLASS_COUNT; cls++) {
+        for (int c = 0; c < 256; c++) {
+            class_table[cls][c] = class_contains((unsigned char) c, cls);
+        }
+#ifdef HTTP_SCAN_X86
+        for (int c = 0; c < 0x80; c++) {
+            if (!class_table[cls][c]) {
+                avx2_low_table[cls][c & 0x0f] |= (uint8_t) (1 << (c >> 4));
+            }
+        }
+        avx2_high_bad[cls] = !class_table[cls][0x80];
+#endif
+    }
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (int kind = HTTP_SCAN_AVX2; kind >= HTTP_SCAN_SCALAR; kind--) {
+        if (cpu_supports(kind)) {
+            scan_ops = &scan_impls[kind];
+            break;
+        }
+    }
+}
+
+const char *http_scan(const char *p, const char *end, enum http_char_class cls) {
+    return scan_ops->scan(p, end, cls);
+}
+
+size_t http_find_head_end(const char *buf, size_t from, size_t len) {
+    return scan_ops->find_head_end(buf, from, len);
+}
+
+enum http_scan_kind http_scan_current() {
+    return scan_ops->kind;
+}
+
+bool http_scan_use(enum http_scan_kind kind) {
+    if (!cpu_supports(kind)) {
+        return false;
+    }
+    scan_ops = &scan_impls[kind];
+    return true;
+}
+
+const char *http_scan_name(enum http_scan_kind kind) {
+    switch (kind) {
+        case HTTP_SCAN_SCALAR:
+            return "scalar";
+        case HTTP_SCAN_SSE42:
+            return "sse42";
+        case HTTP_SCAN_AVX2:
+            return "avx2";
+        default:
+            return "unknown";
+    }
+}
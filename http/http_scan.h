@@ -0,0 +1,43 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_HTTP_SCAN_H
+#define EPOLL_COROUTINE_HTTP_SCAN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// 请求解析里按字符类别整段扫描的部分。启动时按 cpuid 选择 AVX2、SSE4.2 或者标量实现
+enum http_scan_kind {
+    HTTP_SCAN_SCALAR = 0,
+    HTTP_SCAN_SSE42,
+    HTTP_SCAN_AVX2,
+};
+
+enum http_char_class {
+    // 方法和头部名字，RFC 9110 的 tchar
+    HTTP_CLASS_TOKEN = 0,
+    // 请求目标，可见 ASCII 字符
+    HTTP_CLASS_TARGET,
+    // 头部值，除 HT 以外的控制字符都不允许，允许 obs-text
+    HTTP_CLASS_VALUE,
+    HTTP_CLASS_COUNT,
+};
+
+// 返回 [p, end) 里第一个不属于 cls 的字符，全部属于时返回 end
+const char *http_scan(const char *p, const char *end, enum http_char_class cls);
+
+bool http_char_in_class(unsigned char c, enum http_char_class cls);
+
+// 从 from 开始查找 "\r\n\r\n"，返回头部长度（含空行），没找到返回 0
+size_t http_find_head_end(const char *buf, size_t from, size_t len);
+
+enum http_scan_kind http_scan_current();
+
+// 切换实现，CPU 不支持时返回 false。只在没有其他线程解析请求时调用，用于测试和基准
+bool http_scan_use(enum http_scan_kind kind);
+
+const char *http_scan_name(enum http_scan_kind kind);
+
+#endif //EPOLL_COROUTINE_HTTP_SCAN_H
@@ -0,0 +1,323 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "http_server.h"
+
+#define HTTP_LINGER_NS (1000LL * 1000 * 1000)
+
+struct http_conn {
+    const struct http_server *server;
+    struct co_io *io;
+    char *out;
+    size_t out_len;
+    bool failed;
+};
+
+const char *http_status_reason(int status) {
+    switch (status) {
+        case 100:
+            return "Continue";
+        case 200:
+            return "OK";
+        case 201:
+            return "Created";
+        case 204:
+            return "No Content";
+        case 301:
+            return "Moved Permanently";
+        case 302:
+            return "Found";
+        case 304:
+            return "Not Modified";
+        case 400:
+            return "Bad Request";
+        case 403:
+            return "Forbidden";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 413:
+            return "Content Too Large";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 500:
+            return "Internal Server Error";
+        case 501:
+            return "Not Implemented";
+        case 503:
+            return "Service Unavailable";
+        case 505:
+            return "HTTP Version Not Supported";
+        default:
+            return "Unknown";
+    }
+}
+
+static int64_t io_deadline(struct http_conn *conn) {
+    if (conn->server->idle_timeout_ns == -1) {
+        return -1;
+    }
+    return co_now() + conn->server->idle_timeout_ns;
+}
+
+// 缓冲区池用完时不用缓冲区直接回 503 再关连接，不能拿着读缓冲区再排队等，否则连接之间会互相卡住
+static void reject_busy(struct http_conn *conn) {
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                                   "Connection: close\r\nRetry-After: 1\r\n\r\n";
+    co_write(conn->io, response, sizeof(response) - 1, io_deadline(conn));
+    conn->failed = true;
+}
+
+// 写缓冲区只在攒响应时借用，写出去之后马上还给事件循环
+static bool reserve_out(struct http_conn *conn) {
+    if (conn->failed) {
+        return false;
+    }
+    if (conn->out == NULL) {
+        conn->out = co_buffer_alloc();
+        if (conn->out == NULL) {
+            reject_busy(conn);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void release_out(struct http_conn *conn) {
+    co_buffer_free(conn->out);
+    conn->out = NULL;
+    conn->out_len = 0;
+}
+
+static void flush(struct http_conn *conn) {
+    if (conn->out == NULL) {
+        return;
+    }
+    if (conn->out_len > 0 && !conn->failed &&
+        co_write(conn->io, conn->out, conn->out_len, io_deadline(conn)) == -1) {
+        conn->failed = true;
+    }
+    release_out(conn);
+}
+
+static int format_head(char *buf, size_t size, const struct http_response *resp, bool keep_alive, int minor_version) {
+    const char *connection = "";
+    if (!keep_alive) {
+        connection = "Connection: close\r\n";
+    } else if (minor_version == 0) {
+        connection = "Connection: keep-alive\r\n";
+    }
+    return snprintf(buf, size, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n%s%s%s%s%s\r\n",
+                    resp->status, http_status_reason(resp->status), resp->body_len,
+                    resp->content_type != NULL ? "Content-Type: " : "",
+                    resp->content_type != NULL ? resp->content_type : "",
+                    resp->content_type != NULL ? "\r\n" : "",
+                    resp->headers != NULL ? resp->headers : "",
+                    connection);
+}
+
+// 响应先追加到写缓冲区，放不下的正文和缓冲区一起 writev，不再拷贝
+static void write_response(struct http_conn *conn, const struct http_response *resp, bool keep_alive,
+                           int minor_version, bool head_only) {
+    if (!reserve_out(conn)) {
+        return;
+    }
+    size_t space = HTTP_WRITE_BUFFER_SIZE - conn->out_len;
+    int n = format_head(conn->out + conn->out_len, space, resp, keep_alive, minor_version);
+    if (n < 0 || (size_t) n >= space) {
+        flush(conn);
+        if (!reserve_out(conn)) {
+            return;
+        }
+        n = format_head(conn->out, HTTP_WRITE_BUFFER_SIZE, resp, keep_alive, minor_version);
+        if (n < 0 || n >= HTTP_WRITE_BUFFER_SIZE) {
+            conn->failed = true;
+            return;
+        }
+    }
+    conn->out_len += n;
+    if (head_only || resp->body_len == 0) {
+        return;
+    }
+    if (resp->body_len <= HTTP_WRITE_BUFFER_SIZE - conn->out_len) {
+        memcpy(conn->out + conn->out_len, resp->body, resp->body_len);
+        conn->out_len += resp->body_len;
+        return;
+    }
+    struct iovec iov[2] = {
+            {.iov_base = conn->out, .iov_len = conn->out_len},
+            {.iov_base = (void *) resp->body, .iov_len = resp->body_len},
+    };
+    if (co_writev(conn->io, iov, 2, io_deadline(conn)) == -1) {
+        conn->failed = true;
+    }
+    release_out(conn);
+}
+
+static void write_error(struct http_conn *conn, int status) {
+    const char *reason = http_status_reason(status);
+    struct http_response resp = {
+            .status = status,
+            .content_type = "text/plain",
+            .body = reason,
+            .body_len = strlen(reason),
+    };
+    write_response(conn, &resp, false, 1, false);
+}
+
+static bool route_match(const struct http_route *route, const struct http_request *req) {
+    size_t len = strlen(route->path);
+    if (len > 0 && route->path[len - 1] == '*') {
+        return req->path_len >= len - 1 && memcmp(req->path, route->path, len - 1) == 0;
+    }
+    return req->path_len == len && memcmp(req->path, route->path, len) == 0;
+}
+
+// 返回是否保持连接
+static bool handle_request(struct http_conn *conn, const struct http_request *req) {
+    bool path_found = false;
+    const struct http_route *route = NULL;
+    for (size_t i = 0; i < conn->server->route_count; i++) {
+        const struct http_route *candidate = &conn->server->routes[i];
+        if (!route_match(candidate, req)) {
+            continue;
+        }
+        path_found = true;
+        if (candidate->method == NULL || (strlen(candidate->method) == req->method_len &&
+                                          memcmp(candidate->method, req->method, req->method_len) == 0)) {
+            route = candidate;
+            break;
+        }
+    }
+    struct http_response resp = {
+            .status = 200,
+    };
+    if (route != NULL) {
+        route->handler(req, &resp, route->arg);
+    } else {
+        resp.status = path_found ? 405 : 404;
+        const char *reason = http_status_reason(resp.status);
+        resp.content_type = "text/plain";
+        resp.body = reason;
+        resp.body_len = strlen(reason);
+    }
+    bool keep_alive = req->keep_alive && !resp.close;
+    bool head_only = req->method_len == 4 && memcmp(req->method, "HEAD", 4) == 0;
+    write_response(conn, &resp, keep_alive, req->minor_version, head_only);
+    return keep_alive;
+}
+
+// 还有没读的请求数据时直接 close 会发 RST，客户端可能收不到错误响应。
+// 先关闭写端，再丢弃一段时间的输入
+static void linger_close(struct http_conn *conn, char *buf, size_t size) {
+    shutdown(conn->io->fd, SHUT_WR);
+    int64_t deadline = co_now() + HTTP_LINGER_NS;
+    while (co_read(conn->io, buf, size, deadline) > 0) {
+    }
+}
+
+// 连接上没有未处理的数据时把读缓冲区还回去，空闲的连接不占缓冲区。
+// 缓冲区用完时排队等别的连接归还，这时手里没有缓冲区，不会互相卡住
+static char *borrow_in(struct http_conn *conn, char *in, int64_t deadline) {
+    if (in != NULL) {
+        return in;
+    }
+    if (co_wait_readable(conn->io, deadline) != 0) {
+        return NULL;
+    }
+    return co_buffer_alloc_wait(deadline);
+}
+
+void http_serve(const struct http_server *server, struct co_io *io) {
+    struct http_conn conn = {
+            .server = server,
+            .io = io,
+            .out = NULL,
+            .out_len = 0,
+            .failed = false,
+    };
+    char *in = NULL;
+    size_t len = 0;
+    struct http_parser parser;
+    http_parser_init(&parser);
+    bool keep_alive = true;
+    bool continue_sent = false;
+    bool lingering = false;
+    while (keep_alive) {
+        // 缓冲区里已经到齐的流水线请求全部处理完，响应攒在一起写
+        size_t pos = 0;
+        while (in != NULL && keep_alive && !conn.failed) {
+            struct http_request req;
+            ssize_t n = http_parse_request(&parser, in + pos, len - pos, &req);
+            if (n == HTTP_PARSE_INCOMPLETE) {
+                break;
+            }
+            if (n == HTTP_PARSE_ERROR) {
+                write_error(&conn, parser.error_status);
+                keep_alive = false;
+                lingering = true;
+                break;
+            }
+            keep_alive = handle_request(&conn, &req);
+            pos += n;
+            continue_sent = false;
+        }
+        flush(&conn);
+        if (!keep_alive || conn.failed) {
+            break;
+        }
+        // 剩下不完整的请求移到开头，解析状态只记相对偏移，不受影响
+        len -= pos;
+        if (len == 0) {
+            co_buffer_free(in);
+            in = NULL;
+        } else {
+            memmove(in, in + pos, len);
+        }
+        if (parser.head_len > 0 && !parser.chunked &&
+            (int64_t) parser.head_len + parser.content_length > HTTP_READ_BUFFER_SIZE) {
+            write_error(&conn, 413);
+            flush(&conn);
+            lingering = true;
+            break;
+        }
+        if (len == HTTP_READ_BUFFER_SIZE) {
+            write_error(&conn, parser.head_len == 0 ? 431 : 413);
+            flush(&conn);
+            lingering = true;
+            break;
+        }
+        if (parser.expect_continue && !continue_sent) {
+            static const char response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            if (co_write(io, response, sizeof(response) - 1, io_deadline(&conn)) == -1) {
+                break;
+            }
+            continue_sent = true;
+        }
+        int64_t deadline = io_deadline(&conn);
+        in = borrow_in(&conn, in, deadline);
+        if (in == NULL) {
+            break;
+        }
+        ssize_t n = co_read(io, in + len, HTTP_READ_BUFFER_SIZE - len, deadline);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    if (lingering && !conn.failed) {
+        if (in == NULL) {
+            in = co_buffer_alloc();
+        }
+        if (in != NULL) {
+            linger_close(&conn, in, HTTP_READ_BUFFER_SIZE);
+        }
+    }
+    co_buffer_free(in);
+    release_out(&conn);
+    co_io_close(io);
+}
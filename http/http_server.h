@@ -0,0 +1,53 @@
+//
+// Created by agent on 26-10-17.
+//
+
+#ifndef EPOLL_COROUTINE_HTTP_SERVER_H
+#define EPOLL_COROUTINE_HTTP_SERVER_H
+
+#include "http_parser.h"
+#include "../coroutine_imp/co_io.h"
+
+// 读写缓冲区都从事件循环的缓冲区池里借，只在有数据要处理时持有。
+// 读缓冲区要放得下请求头和正文
+#define HTTP_READ_BUFFER_SIZE CO_BUFFER_SIZE
+// 流水线请求的响应先攒在写缓冲区，一轮处理完再一起写
+#define HTTP_WRITE_BUFFER_SIZE CO_BUFFER_SIZE
+
+// 处理函数填写的响应，服务端在处理函数返回后负责序列化。
+// body 和 headers 只需要在处理函数返回前有效
+struct http_response {
+    int status;
+    const char *content_type;
+    // 额外的头部，已经格式化好的 "Name: value\r\n"，可以为 NULL
+    const char *headers;
+    const char *body;
+    size_t body_len;
+    // 处理完这个请求后关闭连接
+    bool close;
+};
+
+typedef void (*http_handler)(const struct http_request *req, struct http_response *resp, void *arg);
+
+struct http_route {
+    // NULL 表示匹配所有方法
+    const char *method;
+    // 以 '*' 结尾时按前缀匹配
+    const char *path;
+    http_handler handler;
+    void *arg;
+};
+
+struct http_server {
+    const struct http_route *routes;
+    size_t route_count;
+    // 等待下一个请求的最长时间，-1 表示不限时
+    int64_t idle_timeout_ns;
+};
+
+// 在当前协程里处理一个连接上的所有请求，直到对端关闭、出错或者超时，返回前关闭连接
+void http_serve(const struct http_server *server, struct co_io *io);
+
+const char *http_status_reason(int status);
+
+#endif //EPOLL_COROUTINE_HTTP_SERVER_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
@@ -12,15 +13,38 @@
 #include <limits.h>
 #include <arpa/inet.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "coroutine_imp/coroutines.h"
+#include "coroutine_imp/co_io.h"
+#include "http/http_server.h"
 
 #define MAX_EVENTS 2048
 #define PORT 8080
-static bool g_running = true;
+// 空闲连接最多占用协程这么久，防止慢速客户端耗尽 co_setup 的协程上限
+#define CLIENT_TIMEOUT_NS (10LL * 1000 * 1000 * 1000)
+#define NO_DEADLINE (-1)
+#define MAX_COROUTINES 5000
+// 每个事件循环最多借出的 I/O 缓冲区，共 64MB
+#define MAX_BUFFERS 4096
+// 连续 accept 这么多个连接后让出一次，SYN 洪水时已经就绪的协程也能运行
+#define ACCEPT_BATCH 64
+// 协程或缓冲区用到上限的这个比例时停止 accept，降到 ADMIT_RESUME_PERCENT 以下再恢复
+#define ADMIT_PAUSE_PERCENT 90
+#define ADMIT_RESUME_PERCENT 75
+// 在其他线程退出的协程不会叫醒 accept 协程，暂停期间隔一段时间复查
+#define ADMIT_RECHECK_NS (10LL * 1000 * 1000)
+// 一次 co_dispatch 最多跑这么久就回去取新的连接和数据
+#define DISPATCH_BUDGET_NS (2LL * 1000 * 1000)
+static atomic_bool g_running = true;
 static int log_level = 3;
-static struct co_event_loop *loop;
-static int64_t success_count = 0;
-static int64_t fail_count = 0;
+static __thread struct co_event_loop *loop;
+static atomic_int_fast64_t success_count = 0;
+static atomic_int_fast64_t fail_count = 0;
+static long g_thread_count = 1;
+static bool g_use_uring = false;
+static struct co_event_loop *_Atomic *g_loops;
+static pthread_barrier_t g_exit_barrier;
 
 static void logging(int level, const char *fmt, va_list args) {
     if (level < log_level) {
@@ -52,18 +76,10 @@ static void error(const char *fmt, ...) {
 
 void sig_handler(int signo) {
     if (signo == SIGINT) {
-        g_running = false;
+        atomic_store(&g_running, false);
     }
 }
 
-int set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) {
-        return -1;
-    }
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
 int set_server_socket() {
     int server_fd;
     struct sockaddr_in address;
@@ -73,9 +89,10 @@ int set_server_socket() {
         exit(EXIT_FAILURE);
     }
 
-    // 设置socket选项
+    // 设置socket选项，每个事件循环线程各自 bind 一个 SO_REUSEPORT 的 socket
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         perror("setsockopt");
         close(server_fd);
         exit(EXIT_FAILURE);
@@ -101,165 +118,126 @@ int set_server_socket() {
     return server_fd;
 }
 
-struct my_epoll_data {
-    int fd;
-    int epoll_fd;
-    uint32_t expect_event_mask;
-    struct co_future *future;
-};
-#define SAVE_ERRNO(x) do {\
-    int _errno = errno;\
-    x;\
-    errno = _errno;\
-} while(0)
+int format_socket_address(struct sockaddr_in *addr, char *buf, size_t size) {
+    return snprintf(buf, size, "%s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+}
 
-static ssize_t coroutine_block_read(int fd, void *buf, size_t count, struct my_epoll_data *data) {
-    while (true) {
-        ssize_t read_size = read(fd, buf, count);
-        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            struct co_future future = co_new_future();
-            data->future = &future;
-            data->expect_event_mask = EPOLLIN | EPOLLHUP;
-            SAVE_ERRNO(co_block());
-            data->future = NULL;
-            continue;
-        }
-        return read_size;
-    }
+static const char hello_body[] = "Hello, World!\r\n";
+
+static void hello_handler(const struct http_request *req, struct http_response *resp, void *arg) {
+    (void) req;
+    (void) arg;
+    resp->content_type = "text/plain";
+    resp->body = hello_body;
+    resp->body_len = sizeof(hello_body) - 1;
 }
 
-static int listen_write_event(int epoll_fd, int fd) {
-    struct epoll_event event;
-    event.events = EPOLLOUT | EPOLLIN | EPOLLET;
-    event.data.fd = fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
-        perror("epoll_ctl: listen_write_event");
-        return -1;
+// 模拟耗时的处理，协程挂起期间同一线程继续处理其他连接
+static void sleep_handler(const struct http_request *req, struct http_response *resp, void *arg) {
+    co_sleep(100 * 1000 * 1000);// sleep 100ms
+    hello_handler(req, resp, arg);
+}
+
+static const struct http_route routes[] = {
+        {"GET", "/sleep", sleep_handler, NULL},
+        {NULL,  "/*",     hello_handler, NULL},
+};
+
+static const struct http_server http_server = {
+        .routes = routes,
+        .route_count = sizeof(routes) / sizeof(routes[0]),
+        .idle_timeout_ns = CLIENT_TIMEOUT_NS,
+};
+
+// 连接状态从本线程的 slab 里分配，客户端协程不会迁移
+static __thread struct co_slab *io_slab;
+
+void handle_client(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    struct co_io *io = co_slab_alloc(io_slab);
+    if (io == NULL) {
+        warning("co_slab_alloc failed\n");
+        close(fd);
+        return;
     }
-    return 0;
+    if (co_io_open(io, fd) != 0) {
+        perror("co_io_open");
+        co_slab_free(io_slab, io);
+        close(fd);
+        return;
+    }
+    http_serve(&http_server, io);
+    co_slab_free(io_slab, io);
 }
 
-static ssize_t coroutine_block_write(int fd, void *buf, size_t count, struct my_epoll_data *data) {
-    while (true) {
-        ssize_t write_size = write(fd, buf, count);
-        if (write_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            struct co_future future = co_new_future();
-            data->future = &future;
-            data->expect_event_mask = EPOLLOUT | EPOLLHUP;
-            if (listen_write_event(data->epoll_fd, fd) == -1) {
-                return -1;
-            }
-            SAVE_ERRNO(co_block());
-            data->future = NULL;
-            continue;
-        } else if (write_size <= 0) {
-            return write_size;
-        } else if (write_size < count) {
-            struct co_future future = co_new_future();
-            data->future = &future;
-            data->expect_event_mask = EPOLLOUT | EPOLLHUP;
-            if (listen_write_event(data->epoll_fd, fd) == -1) {
-                return -1;
-            }
-            count -= write_size;
-            SAVE_ERRNO(co_block());
-            data->future = NULL;
-            continue;
-        }
-        return write_size;
+// fd 在协程里才注册到 epoll，spawn 失败时直接关闭即可
+static void spawn_client(int fd, const char *name) {
+    enum co_error ret = co_spawn_stack(loop, handle_client, (void *) (intptr_t) fd, (char *) name, CO_STACK_32K);
+    if (ret != CO_SUCCESS) {
+        warning("new_coroutine return error, %d\n", ret);
+        fail_count++;
+        close(fd);
+        return;
     }
+    success_count++;
 }
 
-int format_socket_address(struct sockaddr_in *addr, char *buf, size_t size) {
-    return snprintf(buf, size, "%s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+// 协程和缓冲区里用得更满的那个的百分比
+static int load_percent() {
+    struct co_load load;
+    co_loop_load(loop, &load);
+    int percent = load.max_coroutines > 0 ? load.coroutines * 100 / load.max_coroutines : 100;
+    if (load.max_buffers > 0 && load.buffers * 100 / load.max_buffers > percent) {
+        percent = load.buffers * 100 / load.max_buffers;
+    }
+    return percent;
 }
 
-void handle_client(void *arg) {
-    struct my_epoll_data *data = (struct my_epoll_data *) arg;
-    int fd = data->fd;
-    char buffer[1024];
-    ssize_t read_size = coroutine_block_read(fd, buffer, sizeof(buffer), data);
-    if (read_size == 0) {
-        info("client closed\n");
-        close(fd);
-        free(data);
+// 快满时把监听 socket 从 epoll 上摘掉，新连接留在内核的 backlog 里，而不是 accept 之后 spawn 失败再 RST
+static void wait_admission(struct co_io *server) {
+    if (load_percent() < ADMIT_PAUSE_PERCENT) {
         return;
     }
-    char *response = "HTTP/1.1 200 OK\r\n"
-                     "Content-Length: 15\r\n\r\n"
-                     "Hello, World!\r\n";
-    co_sleep(100 * 1000 * 1000);// sleep 100ms
-    ssize_t write_size = coroutine_block_write(fd, response, strlen(response), data);
-    if (write_size == -1) {
-        info("cannot write");
+    warning("overloaded, stop accepting\n");
+    if (co_io_pause(server) != 0) {
+        perror("co_io_pause");
     }
-    close(fd);
-    free(data);
+    while (co_wait_load_below(ADMIT_RESUME_PERCENT, co_now() + ADMIT_RECHECK_NS) == ETIMEDOUT) {
+    }
+    if (co_io_resume(server) != 0) {
+        perror("co_io_resume");
+    }
+    warning("resume accepting\n");
 }
 
-void handle_server(int epoll_fd, int server_fd) {
+// 由一个协程循环 accept，io_uring 模式下连接来自 multishot accept 的缓存
+void accept_loop(void *arg) {
+    struct co_io *server = arg;
+    int batch = 0;
     while (true) {
+        wait_admission(server);
+        if (++batch > ACCEPT_BATCH) {
+            batch = 0;
+            co_yield();
+        }
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
-        int new_socket = accept(server_fd, (struct sockaddr *) &client_addr, &client_len);
-        if (new_socket == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
-            }
-            perror("accept");
-            return;
-        }
-        set_nonblocking(new_socket);
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET;
-        event.data.ptr = malloc(sizeof(struct my_epoll_data));
-        struct my_epoll_data *data = (struct my_epoll_data *) event.data.ptr;
-        data->fd = new_socket;
-        data->epoll_fd = epoll_fd;
-        data->expect_event_mask = EPOLLIN | EPOLLHUP;
-        data->future = NULL;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &event) == -1) {
-            free(event.data.ptr);
-            perror("epoll_ctl: new_socket");
-            close(new_socket);
+        int fd = co_accept(server, (struct sockaddr *) &client_addr, &client_len, NO_DEADLINE);
+        if (fd < 0) {
+            warning("accept: %s\n", strerror(errno));
+            co_sleep(10 * 1000 * 1000);
+            continue;
         }
         char name[32];
         format_socket_address(&client_addr, name, sizeof(name));
-        enum co_error ret = co_spawn(loop, handle_client, data, name);
-        if (ret != CO_SUCCESS) {
-            warning("new_coroutine return error, %d\n", ret);
-            fail_count++;
-            free(event.data.ptr);
-            close(new_socket);
-        }
-        success_count++;
-    }
-}
-
-void handle_events(struct epoll_event *events, int num_events, struct my_epoll_data *epoll_h, int server_fd) {
-    for (int i = 0; i < num_events; i++) {
-        if ((events[i].events & EPOLLIN) && events[i].data.ptr == epoll_h) {
-            // 处理可读事件
-            int epoll_fd = epoll_h->fd;
-            handle_server(epoll_fd, server_fd);
-            continue;
-        }
-        struct my_epoll_data *data = (struct my_epoll_data *) events[i].data.ptr;
-        if (events[i].events & data->expect_event_mask) {
-            if (data->future == NULL) {
-                error("data->future==NULL\n");
-            }
-            co_wakeup(loop, data->future);
-        } else {
-            error("unexpected event %d\n", events[i].events);
-        }
+        spawn_client(fd, name);
     }
 }
 
 void sigquit_handler(int signo) {
     if (signo == SIGQUIT) {
         co_print_all_coroutine();
-        printf("success_count=%ld\nfail_count=%ld\n", success_count, fail_count);
+        printf("success_count=%ld\nfail_count=%ld\n", (int64_t) success_count, (int64_t) fail_count);
     }
 }
 
@@ -276,71 +254,135 @@ int get_log_level(const char *input) {
     return count;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc >= 2) {
-        log_level -= get_log_level(argv[1]);
-    } else {
-        printf("Usage: %s -v|-vv|-vvv\n", argv[0]);
-    }
+int run_event_loop(long index) {
     int server_fd = set_server_socket();
-    struct epoll_event event, events[MAX_EVENTS];
-    if (co_setup(5000) != 0) {
+    struct epoll_event events[MAX_EVENTS];
+    struct co_config config = {
+            .max_size = MAX_COROUTINES,
+            .max_buffers = MAX_BUFFERS,
+            .dispatch_budget_ns = DISPATCH_BUDGET_NS,
+            .io = g_use_uring ? CO_IO_URING : CO_IO_EPOLL,
+    };
+    if (co_setup_with(&config) != 0) {
         error("co_setup failed\n");
-        return -1;
+        close(server_fd);
+        exit(EXIT_FAILURE);
     }
     loop = co_get_loop();
-    // 创建epoll实例
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
-        perror("epoll_create1");
-        close(server_fd);
+    atomic_store(&g_loops[index], loop);
+    io_slab = co_slab_new(sizeof(struct co_io), 64);
+    if (io_slab == NULL) {
+        error("co_slab_new failed\n");
         exit(EXIT_FAILURE);
     }
 
-    // 将服务器socket注册到epoll实例
-    struct my_epoll_data epoll_h = {
-            .fd = epoll_fd,
-            .epoll_fd = epoll_fd,
-            .expect_event_mask = EPOLLIN | EPOLLET,
-            .future = NULL,
-    };
-    event.events = EPOLLIN | EPOLLET;
-    event.data.ptr = &epoll_h;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == -1) {
-        perror("epoll_ctl: server_fd");
+    struct co_io server;
+    if (co_io_open(&server, server_fd) != 0) {
+        perror("co_io_open: server_fd");
         close(server_fd);
-        close(epoll_fd);
+        exit(EXIT_FAILURE);
+    }
+    if (co_spawn_stack(loop, accept_loop, &server, "acceptor", CO_STACK_32K) != CO_SUCCESS) {
+        error("cannot spawn acceptor\n");
         exit(EXIT_FAILURE);
     }
 
-    signal(SIGINT, sig_handler);
-    signal(SIGQUIT, sigquit_handler);
     // 事件循环
-    while (g_running) {
-        int64_t wait_ns = co_min_wait_time();
-        int wait_ms;
-        if (wait_ns == -1) {
-            wait_ms = -1;
-        } else {
-            int64_t wms = wait_ns / 1000000;
-            wait_ms = wms > INT_MAX ? INT_MAX : (int) wms;
-        }
-        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+    while (atomic_load(&g_running)) {
+        int num_events = co_loop_wait(loop, events, MAX_EVENTS);
         if (num_events == -1) {
             if (errno != EINTR) {
                 perror("epoll_wait");
                 close(server_fd);
-                close(epoll_fd);
                 exit(EXIT_FAILURE);
             }
             co_dispatch(loop);
             continue;
         }
-        handle_events(events, num_events, &epoll_h, server_fd);
         co_dispatch(loop);
     }
+    if (index == 0) {
+        // 主线程收到 SIGINT 后负责叫醒其他事件循环
+        for (long i = 1; i < g_thread_count; i++) {
+            struct co_event_loop *other = atomic_load(&g_loops[i]);
+            if (other != NULL) {
+                co_loop_notify(other);
+            }
+        }
+    }
+    // 等所有线程都退出事件循环再销毁，保证 co_loop_notify 不会碰到已经释放的 loop
+    pthread_barrier_wait(&g_exit_barrier);
+    atomic_store(&g_loops[index], NULL);
     co_teardown();
+    co_io_release(&server);
     close(server_fd);
-    close(epoll_fd);
     return 0;
 }
+
+void *event_loop_thread(void *arg) {
+    run_event_loop((long) (intptr_t) arg);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long thread_count = 1;
+    long watchdog_ms = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            thread_count = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            g_use_uring = true;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            watchdog_ms = strtol(argv[++i], NULL, 10);
+        } else {
+            log_level -= get_log_level(argv[i]);
+        }
+    }
+    if (argc < 2) {
+        printf("Usage: %s [-v|-vv|-vvv] [-t threads, 0 for one per core] [-u use io_uring] [-w watchdog slice ms]\n", argv[0]);
+    }
+    if (thread_count <= 0) {
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    g_thread_count = thread_count;
+    if (watchdog_ms > 0) {
+        struct co_watchdog_config watchdog = {
+                .slice_ns = watchdog_ms * 1000 * 1000,
+                .backtrace = true,
+                .preempt = true,
+        };
+        if (co_watchdog_start(&watchdog) != 0) {
+            error("co_watchdog_start failed\n");
+        }
+    }
+    g_loops = calloc(thread_count, sizeof(g_loops[0]));
+    pthread_barrier_init(&g_exit_barrier, NULL, thread_count);
+
+    // 其他线程屏蔽 SIGINT/SIGQUIT，保证信号只投递到主线程
+    sigset_t block_set, old_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    for (long i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, event_loop_thread, (void *) (intptr_t) i) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    signal(SIGINT, sig_handler);
+    signal(SIGQUIT, sigquit_handler);
+    info("listening on port %d with %ld threads%s\n", PORT, thread_count, g_use_uring ? ", io_uring" : "");
+    int ret = run_event_loop(0);
+    for (long i = 1; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    co_watchdog_stop();
+    pthread_barrier_destroy(&g_exit_barrier);
+    free(threads);
+    free(g_loops);
+    return ret;
+}
@@ -0,0 +1,262 @@
+//
+// Created by agent on 26-10-17.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../http/http_parser.h"
+#include "../http/http_scan.h"
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int g_failures = 0;
+static const char *g_case = "";
+
+static void check(bool ok, const char *expr, const char *file, int line) {
+    if (!ok) {
+        printf("%s:%d: [%s/%s] %s\n", file, line, http_scan_name(http_scan_current()), g_case, expr);
+        g_failures++;
+    }
+}
+
+static bool equal(const char *s, size_t len, const char *expected) {
+    return len == strlen(expected) && memcmp(s, expected, len) == 0;
+}
+
+static bool header_is(const struct http_request *req, const char *name, const char *value) {
+    const struct http_header *header = http_find_header(req, name);
+    return header != NULL && equal(header->value, header->value_len, value);
+}
+
+// 整个请求一次给完，返回解析结果，buf 是可写的拷贝
+static ssize_t parse_all(const char *text, char *buf, struct http_parser *parser, struct http_request *req) {
+    size_t len = strlen(text);
+    memcpy(buf, text, len);
+    http_parser_init(parser);
+    return http_parse_request(parser, buf, len, req);
+}
+
+static int parse_error(const char *text) {
+    char buf[4096];
+    struct http_parser parser;
+    struct http_request req;
+    if (parse_all(text, buf, &parser, &req) != HTTP_PARSE_ERROR) {
+        return 0;
+    }
+    return parser.error_status;
+}
+
+// 每次多给一个字节，并且每次都把已有的数据搬到新的缓冲区里，和服务器挪动读缓冲区一样
+static ssize_t parse_split(const char *text, char **out, struct http_request *req) {
+    size_t len = strlen(text);
+    struct http_parser parser;
+    http_parser_init(&parser);
+    char *buf = NULL;
+    for (size_t n = 1; n <= len; n++) {
+        char *moved = malloc(len);
+        if (buf != NULL) {
+            memcpy(moved, buf, n - 1);
+            memset(buf, 0, n - 1);
+            free(buf);
+        }
+        moved[n - 1] = text[n - 1];
+        buf = moved;
+        ssize_t ret = http_parse_request(&parser, buf, n, req);
+        if (ret != HTTP_PARSE_INCOMPLETE || n == len) {
+            *out = buf;
+            return n == len ? ret : -100 - (ssize_t) n;
+        }
+    }
+    *out = buf;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+static void test_simple() {
+    g_case = "simple";
+    static const char text[] = "GET /index.html?q=1 HTTP/1.1\r\nHost: example.com\r\nX-Empty:\r\n"
+                               "User-Agent:  test \t\r\n\r\n";
+    char buf[sizeof(text)];
+    struct http_parser parser;
+    struct http_request req;
+    CHECK(parse_all(text, buf, &parser, &req) == (ssize_t) strlen(text));
+    CHECK(equal(req.method, req.method_len, "GET"));
+    CHECK(equal(req.path, req.path_len, "/index.html?q=1"));
+    CHECK(req.minor_version == 1);
+    CHECK(req.keep_alive);
+    CHECK(!req.expect_continue);
+    CHECK(req.header_count == 3);
+    CHECK(header_is(&req, "host", "example.com"));
+    CHECK(header_is(&req, "X-EMPTY", ""));
+    CHECK(header_is(&req, "user-agent", "test"));
+    CHECK(req.body_len == 0);
+}
+
+static void test_keep_alive() {
+    g_case = "keep_alive";
+    char buf[256];
+    struct http_parser parser;
+    struct http_request req;
+    CHECK(parse_all("GET / HTTP/1.0\r\n\r\n", buf, &parser, &req) > 0);
+    CHECK(req.minor_version == 0 && !req.keep_alive);
+    CHECK(parse_all("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n", buf, &parser, &req) > 0);
+    CHECK(req.keep_alive);
+    CHECK(parse_all("GET / HTTP/1.1\r\nConnection: foo, close\r\n\r\n", buf, &parser, &req) > 0);
+    CHECK(!req.keep_alive);
+}
+
+static void test_content_length() {
+    g_case = "content_length";
+    static const char text[] = "POST /upload HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello";
+    char buf[256];
+    struct http_parser parser;
+    struct http_request req;
+    CHECK(parse_all(text, buf, &parser, &req) == (ssize_t) strlen(text));
+    CHECK(equal(req.body, req.body_len, "hello"));
+    // 同样的值重复出现可以接受
+    CHECK(parse_all("POST / HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 2\r\n\r\nok", buf, &parser, &req) > 0);
+    CHECK(equal(req.body, req.body_len, "ok"));
+}
+
+static void test_chunked() {
+    g_case = "chunked";
+    static const char text[] = "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                               "4;name=value\r\nWiki\r\n5 ;x\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n"
+                               "0\r\nExpires: never\r\nX-Trailer: 1\r\n\r\n";
+    char buf[sizeof(text)];
+    struct http_parser parser;
+    struct http_request req;
+    CHECK(parse_all(text, buf, &parser, &req) == (ssize_t) strlen(text));
+    CHECK(equal(req.body, req.body_len, "Wikipedia in\r\n\r\nchunks."));
+    // trailer 不算进头部
+    CHECK(http_find_header(&req, "expires") == NULL);
+    CHECK(parse_error("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n") == 400);
+    CHECK(parse_error("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcX\r\n") == 400);
+}
+
+static void test_split() {
+    g_case = "split";
+    static const char chunked[] = "POST /c HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                  "3;ext\r\nabc\r\n2\r\nde\r\n0\r\nT: x\r\n\r\n";
+    struct http_request req;
+    char *buf;
+    CHECK(parse_split(chunked, &buf, &req) == (ssize_t) strlen(chunked));
+    // 指针要指向最后一次的缓冲区
+    CHECK(req.method == buf);
+    CHECK(equal(req.path, req.path_len, "/c"));
+    CHECK(header_is(&req, "host", "a"));
+    CHECK(equal(req.body, req.body_len, "abcde"));
+    free(buf);
+    static const char fixed[] = "PUT /f HTTP/1.1\r\nContent-Length: 10\r\nX: y\r\n\r\n0123456789";
+    CHECK(parse_split(fixed, &buf, &req) == (ssize_t) strlen(fixed));
+    CHECK(req.method == buf);
+    CHECK(header_is(&req, "x", "y"));
+    CHECK(equal(req.body, req.body_len, "0123456789"));
+    free(buf);
+}
+
+static void test_pipelined() {
+    g_case = "pipelined";
+    static const char text[] = "GET /a HTTP/1.1\r\n\r\n"
+                               "POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nxyz"
+                               "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nq\r\n0\r\n\r\n"
+                               "GET /d HTTP/1.1\r\nHo";
+    char buf[sizeof(text)];
+    size_t len = strlen(text);
+    memcpy(buf, text, len);
+    struct http_parser parser;
+    struct http_request req;
+    http_parser_init(&parser);
+    size_t pos = 0;
+    ssize_t n = http_parse_request(&parser, buf + pos, len - pos, &req);
+    CHECK(n > 0 && equal(req.path, req.path_len, "/a") && req.body_len == 0);
+    pos += n;
+    n = http_parse_request(&parser, buf + pos, len - pos, &req);
+    CHECK(n > 0 && equal(req.path, req.path_len, "/b") && equal(req.body, req.body_len, "xyz"));
+    pos += n;
+    n = http_parse_request(&parser, buf + pos, len - pos, &req);
+    CHECK(n > 0 && equal(req.path, req.path_len, "/c") && equal(req.body, req.body_len, "q"));
+    pos += n;
+    n = http_parse_request(&parser, buf + pos, len - pos, &req);
+    CHECK(n == HTTP_PARSE_INCOMPLETE);
+    CHECK(len - pos == strlen("GET /d HTTP/1.1\r\nHo"));
+}
+
+static void test_expect_continue() {
+    g_case = "expect_continue";
+    static const char text[] = "PUT /x HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 4\r\n\r\n";
+    char buf[64];
+    size_t len = strlen(text);
+    memcpy(buf, text, len);
+    struct http_parser parser;
+    struct http_request req;
+    http_parser_init(&parser);
+    // 头部到齐、正文还没到时服务器靠这两个字段决定要不要先回 100
+    CHECK(http_parse_request(&parser, buf, len, &req) == HTTP_PARSE_INCOMPLETE);
+    CHECK(parser.head_len == len);
+    CHECK(parser.expect_continue);
+    CHECK(parser.content_length == 4);
+    memcpy(buf + len, "data", 4);
+    CHECK(http_parse_request(&parser, buf, len + 4, &req) == (ssize_t) len + 4);
+    CHECK(req.expect_continue);
+    CHECK(equal(req.body, req.body_len, "data"));
+}
+
+static void test_errors() {
+    g_case = "errors";
+    // 请求走私：两种边界同时出现，或者 Content-Length 前后不一致
+    CHECK(parse_error("POST / HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n") == 400);
+    CHECK(parse_error("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n") == 400);
+    CHECK(parse_error("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\n") == 400);
+    CHECK(parse_error("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == 400);
+    CHECK(parse_error("POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n") == 400);
+    CHECK(parse_error("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n") == 501);
+    // obs-fold、名字后面的空白、裸 LF
+    CHECK(parse_error("GET / HTTP/1.1\r\nX: a\r\n b\r\n\r\n") == 400);
+    CHECK(parse_error("GET / HTTP/1.1\r\nX : a\r\n\r\n") == 400);
+    CHECK(parse_error("GET / HTTP/1.1\r\nHost: a\nX: b\r\n\r\n") == 400);
+    CHECK(parse_error("GET / HTTP/1.1\nHost: a\r\n\r\n") == 400);
+    // 请求行
+    CHECK(parse_error("GET / HTTP/2.0\r\n\r\n") == 505);
+    CHECK(parse_error("GET / HTTP/1.2\r\n\r\n") == 505);
+    CHECK(parse_error("GET / HTTP/1.1 \r\n\r\n") == 400);
+    CHECK(parse_error("GET / FOO/1.1\r\n\r\n") == 400);
+    CHECK(parse_error("GET  / HTTP/1.1\r\n\r\n") == 400);
+    CHECK(parse_error("G(T / HTTP/1.1\r\n\r\n") == 400);
+    CHECK(parse_error("GET /a\x01 HTTP/1.1\r\n\r\n") == 400);
+    CHECK(parse_error("GET / HTTP/1.1\r\nX: a\x7f\r\n\r\n") == 400);
+}
+
+static void test_too_many_headers() {
+    g_case = "too_many_headers";
+    char text[2048];
+    int len = snprintf(text, sizeof(text), "GET / HTTP/1.1\r\n");
+    for (int i = 0; i <= HTTP_MAX_HEADERS; i++) {
+        len += snprintf(text + len, sizeof(text) - len, "H%d: v\r\n", i);
+    }
+    snprintf(text + len, sizeof(text) - len, "\r\n");
+    CHECK(parse_error(text) == 431);
+}
+
+int main() {
+    for (int kind = HTTP_SCAN_SCALAR; kind <= HTTP_SCAN_AVX2; kind++) {
+        // CPU 不支持的实现跳过
+        if (!http_scan_use(kind)) {
+            continue;
+        }
+        test_simple();
+        test_keep_alive();
+        test_content_length();
+        test_chunked();
+        test_split();
+        test_pipelined();
+        test_expect_continue();
+        test_errors();
+        test_too_many_headers();
+    }
+    if (g_failures > 0) {
+        printf("%d check(s) failed\n", g_failures);
+        return EXIT_FAILURE;
+    }
+    printf("all passed\n");
+    return EXIT_SUCCESS;
+}